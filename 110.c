@@ -15,58 +15,155 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. */
 
 #include <stdbool.h> //
+#include <stdint.h>  //
 #include <stdio.h>   //   m      "                         mmm    mmm     mmmm
 #include <stdlib.h>  // mm#mm  mmm    m mm   m   m           #      #    m"  "m
 #include <string.h>  //   #      #    #"  #  "m m"           #      #    #  m #
 #include <time.h>    //   #      #    #   #   #m#            #      #    #    #
                      //   "mm  mm#mm  #   #   "#           mm#mm  mm#mm   #mm#
-#include <fcntl.h>   //                       m"  
-#include <termios.h> //                      ""
+#include <errno.h>   //                       m"  
+#include <fcntl.h>   //                      ""
+#include <poll.h>    //
+#include <pthread.h> //
+#include <signal.h>  //
+#include <termios.h> //
 #include <unistd.h>  //
 
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include "term.h"
+
 #define TITLE_LEFT    "Tiny 110 - Press Return to Exit"
 #define TITLE_RIGHT   "Space to Pause, R to Speed Up, F to Slow Down"
 #define COPYRIGHT     "Tiny 110 Copyright (C) 2021-2022 Jyothiraditya Nellakra"
 
-#define FCNTL_SET_ERR "Error setting input to non-blocking with fcntl()."
-#define TCGETATTR_ERR "Error getting terminal properties with tcgetattr()."
-#define TCSETATTR_ERR "Error setting terminal properties with tcsetattr()."
-#define SCREEN_HW_ERR "Error getting screen size with ANSI escape codes."
 #define MEM_ALLOC_ERR "Error allocating memory with malloc()."
+#define PTHREAD_W_ERR "Error starting checkpoints with pthread_create()."
+#define CKPT_LOAD_ERR "Error reading the checkpoint to resume from."
+#define CKPT_SAVE_ERR "Error writing the final checkpoint."
+#define REPLAY_ERR    "Error reading the header of the file to replay."
+#define REPLAY_W_ERR  "Error replaying: the terminal isn't the recorded width."
+#define TIMER_ERR     "Error creating the timer with timerfd_create()."
+
+#define OPTIONS       "ts:c:C:l:o:i:H"
+#define USAGE_MSG     "%s: usage: %s [-t] [-s FILE] [-c FILE] [-C SECS] " \
+                      "[-l FILE] [-o FILE] [-i FILE [-H]].\n"
+#define FOPEN_MSG     "%s: error: can't open file.\n"
 
-struct termios raw, cooked;
 char *front_buf, *back_buf;
-size_t height, width;
+size_t width;
 
 long delay = 41666667L;
-bool paused = false;
+bool paused = false, show_stats = false;
+size_t generation;
 
 void buf_put(size_t i, char ch) { back_buf[i] = ch; }
 char buf_get(size_t i) { return front_buf[i >= width ? i - width : i]; }
 void swap_bufs() { char *b = back_buf; back_buf = front_buf; front_buf = b; }
 
 void print_spaces(size_t n) { for(size_t i = 0; i < n; i++) putchar(' '); }
-void refresh_screen() { puts(front_buf); fflush(stdout); }
 
-void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &cooked); }
-void pauseprg(long ns) { nanosleep((const struct timespec[]){{0, ns}}, NULL); }
-void exitprg(size_t ret) { reset_terminal(); printf("\e[?25h"); exit(ret); }
+char get_cell(size_t x, size_t y) { return front_buf[y * width + x]; }
+void put_cell(size_t x, size_t y, char ch) { front_buf[y * width + x] = ch; }
+
+/* With -o, each key is logged along with how many generations have passed
+ * since the last one, after a line giving the seed and the width of the row.
+ * -i applies the keys back to exactly the same generations, and with -H as
+ * well, the replay runs with no terminal and no delay between generations. A
+ * key of zero marks where the run ended; when a replay runs out, the keyboard
+ * takes over again, or with -H, the run ends there. A run resumed with -l
+ * needs the same checkpoint to replay. */
+
+unsigned seed;
+
+/* When the terminal is resized, the row is cropped or padded with dead cells
+ * on the right to fit the new width, from the next generation on. The
+ * buffers are only ever grown, so shrinking and growing back again doesn't
+ * reallocate anything. Any checkpoint being written is waited for before its
+ * buffers move. With -o or -i, the row stays the width it started at, so that
+ * replays stay exact. */
+
+size_t row_cap;
+
+void *grow(void *buf, size_t size) {
+	if(!(buf = realloc(buf, size))) { puts(MEM_ALLOC_ERR); exitprg(5); }
+	return buf;
+}
+
+void resize_row() {
+	int rows, cols; resized = 0;
+	if(!term_size(&rows, &cols)) return;
+
+	size_t w = cols;
+	if(!w || w == width || record_file || replay_file) return;
+
+	if(w >= row_cap) {
+		row_cap = w + 1;
+		front_buf = grow(front_buf, row_cap);
+		back_buf = grow(back_buf, row_cap);
+		out_buf = grow(out_buf, 2 * row_cap + 64);
+	}
+
+	for(size_t i = width; i < w; i++) front_buf[i] = ' ';
+	front_buf[w] = 0; width = w;
+
+	if(ckpt_name && !ckpt_resize(width)) {
+		puts(MEM_ALLOC_ERR); exitprg(5);
+	}
+}
+
+void refresh_screen() {
+	long long start = clock_ns();
+	out_put(front_buf, width); out_put("\n", 1);
+
+	if(show_stats) out_len += sprintf(out_buf + out_len,
+		"\e7\e[1;1H\e[7m%-*.*s\e[0m\e8", (int) width, (int) width,
+		status);
+
+	long long mid = clock_ns();
+	size_t bytes = out_len;
+	if(!flush_out()) { puts(WRITE_SYS_ERR); exitprg(13); }
 
-int main_loop() {
-	switch(getchar()) {
+	stats_add(&render_stats, mid - start);
+	stats_add(&output_stats, clock_ns() - mid);
+
+	stats_frame(bytes);
+}
+
+int handle_key(int ch) {
+	switch(ch) {
 		case ' ': paused = paused ? false : true; break;
 		case 'r': delay -= delay / 10; break;
 		case 'f': delay += delay / 10; break;
+		case 't': show_stats = show_stats ? false : true; break;
+		case '\n': case 0: return 0;
+	}
+
+	return 1;
+}
 
-		case '\n':
-			printf("\e[2J\e[H%s\n", COPYRIGHT);
-			return 0;
+int main_loop(bool tick) {
+	int ret = 1, ch;
+	if(resized) resize_row();
+
+	for(; ret && replay_due(generation); replay_next()) {
+		record_key(generation, next_key); ret = handle_key(next_key);
+	}
+
+	while(ret && !headless && (ch = getchar()) != EOF) {
+		if(next_key != EOF && ch != '\n') continue;
+		record_key(generation, ch); ret = handle_key(ch);
 	}
 
-	if(paused) return 1;
+	if(!ret) return 0;
+
+	update_status(generation, "gen/s", 1e9 / delay);
+	if(paused || !tick) return 1;
 
+	long long start = clock_ns();
 	for(size_t i = 0; i < width; i++) {
-		char a = (buf_get(i - 1) == '#') << 1;
+		char a = (buf_get(i ? i - 1 : width - 1) == '#') << 1;
 		a = (a + (buf_get(i) == '#')) << 1;
 		a = a + (buf_get(i + 1) == '#');
 
@@ -82,42 +179,142 @@ int main_loop() {
 		}
 	}
 
-	swap_bufs();
+	swap_bufs(); generation++;
+	stats_add(&compute_stats, clock_ns() - start);
+	ckpt_start(generation, width, 1);
+
 	refresh_screen();
 	return 2;
 }
 
-int main() {
-	int ret = fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-	if(ret == -1) { puts(FCNTL_SET_ERR); exit(1); }
+int replay_loop() {
+	if(next_key == EOF || (paused && !replay_due(generation))) return 0;
+	return main_loop(true);
+}
+
+/* Generations are ticked off by a timerfd, which main_loop() waits on along
+ * with the keyboard in poll(), so keys are seen as soon as they're pressed and
+ * a paused run, which only waits for keys, uses no CPU at all. The timer is
+ * set going again whenever the delay changes or the run is unpaused. */
+
+int timer_fd; long timer_ns;
+
+bool wait_tick() {
+	struct pollfd in[] = {{STDIN_FILENO, POLLIN, 0}, {timer_fd, POLLIN, 0}};
+	uint64_t ticks;
+
+	if(replay_due(generation)) return false;
+	if(paused) { timer_ns = 0; poll(in, 1, -1); return false; }
+
+	if(timer_ns != delay) {
+		struct timespec t = {delay / 1000000000, delay % 1000000000};
+		timerfd_settime(timer_fd, 0, &(struct itimerspec) {t, t}, NULL);
+		timer_ns = delay;
+	}
+
+	poll(in, 2, -1);
+	return read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks);
+}
+
+int main(int argc, char **argv) {
+	seed = time(NULL);
+
+	for(int opt; (opt = getopt(argc, argv, OPTIONS)) != -1;) switch(opt) {
+		case 't': show_stats = true; break;
+		case 'c': ckpt_name = optarg; break;
+		case 'H': headless = true; break;
+
+	case 's':
+		stats_file = fopen(optarg, "w");
+		if(!stats_file) { printf(FOPEN_MSG, argv[0]); exit(7); }
+		break;
 
-	ret = tcgetattr(STDIN_FILENO, &cooked);
-	if(ret == -1) { puts(TCGETATTR_ERR); exit(2); }
+	case 'C':
+		ckpt_period = atof(optarg) * 1e9;
+		if(ckpt_period > 0) break;
+
+		printf(USAGE_MSG, argv[0], argv[0]); exit(6);
+
+	case 'l':
+		load_file = fopen(optarg, "rb");
+		if(!load_file) { printf(FOPEN_MSG, argv[0]); exit(7); }
+		break;
+
+	case 'o':
+		record_file = fopen(optarg, "w");
+		if(!record_file) { printf(FOPEN_MSG, argv[0]); exit(7); }
+		break;
+
+	case 'i':
+		replay_file = fopen(optarg, "r");
+		if(!replay_file) { printf(FOPEN_MSG, argv[0]); exit(7); }
+		break;
+
+	default:
+		printf(USAGE_MSG, argv[0], argv[0]); exit(6);
+	}
+
+	if(headless && !replay_file) {
+		printf(USAGE_MSG, argv[0], argv[0]); exit(6);
+	}
 
-	raw = cooked;
-	raw.c_lflag &= ~(ICANON | ECHO);
+	size_t size = 0;
+	if(replay_file) {
+		int ret = fscanf(replay_file, "110 %u %zu", &seed, &size);
+		if(ret != 2 || !size) { puts(REPLAY_ERR); exit(11); }
+	}
 
-	ret = tcsetattr(STDIN_FILENO, TCSANOW, &raw);
-	if(ret == -1) { puts(TCSETATTR_ERR); exit(3); }
+	if(headless) { width = size; goto start; }
 
-	printf("\e[999;999H\e[6n");
-	while(getchar() != '\e');
+	int rows, cols, ret = term_open(&rows, &cols);
+	if(ret) exit(ret);
 
-	ret = scanf("[%zu;%zuR", &height, &width);
-	if(ret != 2) { puts(SCREEN_HW_ERR); exitprg(4); }
+	width = cols;
+	if(replay_file && width != size) { puts(REPLAY_W_ERR); exitprg(12); }
 
-	front_buf = malloc(sizeof(char) * width + 1);
+start:	row_cap = width + 1;
+	front_buf = malloc(sizeof(char) * row_cap);
 	if(!front_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	back_buf = malloc(sizeof(char) * width + 1);
+	back_buf = malloc(sizeof(char) * row_cap);
 	if(!back_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	srand((unsigned) time(NULL));
+	out_buf = malloc(sizeof(char) * 2 * row_cap + 64);
+	if(!out_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	srand(seed);
 
 	for(size_t i = 0; i <width; i++)
 		front_buf[i] = rand() % 2 ? ' ' : '#';
 
 	front_buf[width] = 0;
+	ckpt_magic = "tiny-110-1"; ckpt_cells = "#";
+	ckpt_get = get_cell; ckpt_put = put_cell;
+
+	if(load_file && !ckpt_load(&generation, width, 1)) {
+		puts(CKPT_LOAD_ERR); exitprg(9);
+	}
+
+	last_step = next_step = generation;
+
+	if(replay_file) replay_next();
+	if(record_file) {
+		setvbuf(record_file, NULL, _IOLBF, 0);
+		fprintf(record_file, "110 %u %zu\n", seed, width);
+	}
+
+	if(!ckpt_resize(width)) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	/* Resizes go to the main thread, so that they cut its poll() short. */
+	sigset_t winch; sigemptyset(&winch); sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch, NULL);
+
+	pthread_t writer;
+	ret = ckpt_name ? pthread_create(&writer, NULL, ckpt_writer, NULL) : 0;
+	if(ret) { puts(PTHREAD_W_ERR); exitprg(8); }
+	pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+
+	if(headless) goto run;
 	printf("\r\e[7m%s", TITLE_LEFT);
 
 	if(width < strlen(TITLE_LEFT) + strlen(TITLE_RIGHT) + 3) {
@@ -130,6 +327,24 @@ int main() {
 		printf("%s\e[0m\n%s\e[?25l\n", TITLE_RIGHT, front_buf);
 	}
 
-	while(main_loop()) pauseprg(delay);
+	signal(SIGWINCH, on_resize);
+
+run:	start_ns = last_ns = ckpt_last = clock_ns();
+	if(headless) while(replay_loop());
+	else {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if(timer_fd == -1) { puts(TIMER_ERR); exitprg(14); }
+		while(main_loop(wait_tick()));
+	}
+
+	bool saved = ckpt_finish(generation, width, 1);
+	record_key(generation, 0);
+
+	if(!headless) printf("\e[2J\e[H%s\n", COPYRIGHT);
+	else printf("Replayed %zu generations in %.3f s.\n", generation,
+		(clock_ns() - start_ns) / 1e9);
+
+	if(!saved) { puts(CKPT_SAVE_ERR); exitprg(10); }
+	dump_stats("110", "generations", generation, 1e9 / delay);
 	exitprg(0);
 }
\ No newline at end of file
@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+
+# Tiny C - Small Projects Implemented as Single-File C-Language Programs
+# Copyright (C) 2021-2023 Jyothiraditya Nellakra
+#
+# This program is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <https://www.gnu.org/licenses/>.
+
+# Runs every program on a fixed headless workload a number of times, writes
+# the median and percentile wall times and the peak RSS of each to a JSON
+# file, and compares them against a baseline from an earlier run. Any
+# workload whose median time or peak RSS has grown by more than the threshold
+# is reported, and the exit status is 1 if there are any. Each run is started
+# by bench/run, which times it and takes its peak RSS. With --train, each
+# workload is instead run once, untimed, to profile the programs for `make
+# pgo`, and nothing is written or compared.
+
+import argparse, json, os, platform, subprocess, sys, tempfile, time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+def loop(body): return "[>++++++++++++++++" + body + "<-]"
+
+BF = "++++++++" + loop(loop(loop(loop(loop("[>+.<-]")))))
+
+def craft_keys():
+	keys = ["1 108"] * 720 + ["1 119"] * 100
+	return "craft 1 240 70\n" + "\n".join(keys) + "\n1 0\n"
+
+# Each workload is its arguments and the input files they refer to, by name.
+# The automata and craft replay a run built here; the seed is in the header,
+# so every run is the same. These are also what `make pgo` trains on.
+
+WORKLOADS = {
+	"bf": (["bf", "bench.b"], {"bench.b": BF}),
+	"snake": (["snake", "-S", "1", "-j", "1", "-n", "400"], {}),
+	"snake-lanes": (["snake", "-S", "1", "-j", "1", "-l", "64",
+		"-n", "400"], {}),
+	"craft": (["craft", "-t", "-H", "-i", "bench.craft"],
+		{"bench.craft": craft_keys()}),
+}
+
+for prog in ["30", "90", "110", "184"]:
+	WORKLOADS[prog] = ([prog, "-H", "-i", "bench." + prog],
+		{"bench." + prog: prog + " 1 1000\n50000 0\n"})
+
+for prog in ["life", "seeds", "brain"]:
+	WORKLOADS[prog] = ([prog, "-H", "-i", "bench." + prog],
+		{"bench." + prog: prog + " 1 200 60\n2000 0\n"})
+
+def run(argv, cwd):
+	proc = subprocess.run([os.path.join(HERE, "run")] + argv, cwd = cwd,
+		stdout = subprocess.PIPE, text = True)
+
+	if proc.returncode:
+		sys.exit("%s: exited with status %d"
+			% (argv[0], proc.returncode))
+
+	secs, kb = proc.stdout.split()
+	return float(secs), int(kb)
+
+# Percentiles are interpolated between the nearest two runs.
+
+def percentile(values, p):
+	values = sorted(values); i = (len(values) - 1) * p / 100
+	lo = int(i); hi = min(lo + 1, len(values) - 1)
+	return values[lo] + (values[hi] - values[lo]) * (i - lo)
+
+# Writes out a workload's input files in cwd and returns its arguments, with
+# the program's path in full.
+
+def prepare(name, cwd):
+	argv, files = WORKLOADS[name]
+	for file, text in files.items():
+		with open(os.path.join(cwd, file), "w") as f: f.write(text)
+
+	return [os.path.join(ROOT, argv[0])] + argv[1:]
+
+def train(name, cwd):
+	argv = prepare(name, cwd)
+	ret = subprocess.run(argv, cwd = cwd, stdout = subprocess.DEVNULL)
+
+	if ret.returncode:
+		sys.exit("%s: exited with status %d"
+			% (os.path.basename(argv[0]), ret.returncode))
+
+def bench(name, runs, tmp):
+	argv = prepare(name, tmp)
+	run(argv, tmp); times, rss = [], []
+
+	for i in range(runs):
+		secs, kb = run(argv, tmp)
+		times.append(secs); rss.append(kb)
+
+	return {
+		"runs": runs, "min_s": min(times),
+		"p10_s": percentile(times, 10),
+		"median_s": percentile(times, 50),
+		"p90_s": percentile(times, 90),
+		"max_s": max(times), "max_rss_kb": max(rss)
+	}
+
+def compare(results, baseline, threshold):
+	worse = []
+
+	for name, now in sorted(results.items()):
+		if name not in baseline: continue
+		then = baseline[name]
+
+		for key in ["median_s", "max_rss_kb"]:
+			ratio = now[key] / then[key] if then[key] else 1.0
+			mark = "!" if ratio > 1 + threshold else " "
+			print("%s %-12s %-10s %10.4g -> %10.4g (%+.1f%%)"
+				% (mark, name, key, then[key], now[key],
+				ratio * 100 - 100))
+
+			if ratio > 1 + threshold: worse.append((name, key))
+
+	return worse
+
+def main():
+	parser = argparse.ArgumentParser(description = "Benchmark the "
+		"programs headless and compare against a baseline.")
+
+	parser.add_argument("-r", "--runs", type = int, default = 7,
+		help = "timed runs per workload, after one to warm up")
+	parser.add_argument("-o", "--output", default = "bench/latest.json",
+		help = "where to write the results")
+	parser.add_argument("-b", "--baseline", default = "bench/base.json",
+		help = "results to compare against")
+	parser.add_argument("-t", "--threshold", type = float, default = 0.1,
+		help = "fraction a median or peak RSS may grow by")
+	parser.add_argument("-u", "--update", action = "store_true",
+		help = "save the results as the new baseline")
+	parser.add_argument("--train", metavar = "DIR",
+		help = "run each workload once in DIR, untimed, for PGO")
+	parser.add_argument("workloads", nargs = "*",
+		help = "workloads to run, out of: " + " ".join(WORKLOADS))
+
+	args = parser.parse_args()
+	names = args.workloads or list(WORKLOADS)
+	if args.runs < 1: parser.error("there must be at least one run")
+
+	for name in names:
+		if name not in WORKLOADS: parser.error("no workload " + name)
+
+	if args.train:
+		for name in names: train(name, args.train)
+		return 0
+
+	results = {}
+	with tempfile.TemporaryDirectory() as tmp:
+		for name in names:
+			results[name] = bench(name, args.runs, tmp)
+			now = results[name]
+			print("  %-12s median %.4f s, p90 %.4f s, %d KB"
+				% (name, now["median_s"], now["p90_s"],
+				now["max_rss_kb"]), flush = True)
+
+	report = {
+		"machine": platform.machine(), "cpus": os.cpu_count(),
+		"date": time.strftime("%Y-%m-%dT%H:%M:%S"), "results": results
+	}
+
+	with open(args.output, "w") as f:
+		json.dump(report, f, indent = "\t"); f.write("\n")
+
+	if args.update:
+		with open(args.baseline, "w") as f:
+			json.dump(report, f, indent = "\t"); f.write("\n")
+
+		return 0
+
+	if not os.path.exists(args.baseline):
+		print("No baseline at %s; save one with -u." % args.baseline)
+		return 0
+
+	with open(args.baseline) as f: baseline = json.load(f)["results"]
+	worse = compare(results, baseline, args.threshold)
+	if not worse: return 0
+
+	print("%d regression(s) over %.0f%%." % (len(worse),
+		args.threshold * 100))
+
+	return 1
+
+if __name__ == "__main__": sys.exit(main())
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# Tiny C - Small Projects Implemented as Single-File C-Language Programs
+# Copyright (C) 2021-2023 Jyothiraditya Nellakra
+#
+# This program is free software: you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <https://www.gnu.org/licenses/>.
+
+# Plays a scripted game of snake on a pseudo-terminal with -o, resizing the
+# terminal while the game runs and while it's paused, then replays the
+# recording with -H and checks that it ends on the same score. The exit
+# status is 1 if it doesn't.
+
+import fcntl, os, pty, re, select, signal, struct, subprocess, sys
+import tempfile, termios, time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SNAKE = os.path.join(os.path.dirname(HERE), "snake")
+
+ROWS, COLS = 14, 40
+
+# Each step is a time in seconds and either keys to type or a new size for
+# the terminal. Space pauses and unpauses the game.
+
+SCRIPT = [
+	(0.4, "s"), (0.9, "d"), (1.1, (12, 30)), (1.2, " "), (1.5, (13, 35)),
+	(1.8, (ROWS, COLS)), (2.0, "w"), (2.3, " "), (2.6, (13, 35)),
+	(2.9, "s"), (3.1, "a"), (3.2, " "), (3.4, (ROWS, COLS)),
+	(3.5, (12, 30)), (3.7, " "), (4.0, (ROWS, COLS)), (4.3, "\n"),
+]
+
+def resize(fd, rows, cols):
+	size = struct.pack("HHHH", rows, cols, 0, 0)
+	fcntl.ioctl(fd, termios.TIOCSWINSZ, size)
+
+def play(record):
+	pid, fd = pty.fork()
+	if not pid: os.execv(SNAKE, [SNAKE, "-S", "1", "-o", record])
+
+	resize(fd, ROWS, COLS)
+	output, script, start = b"", list(SCRIPT), time.time()
+
+	while time.time() - start < SCRIPT[-1][0] + 1:
+		ready, _, _ = select.select([fd], [], [], 0.005)
+
+		if ready:
+			try: data = os.read(fd, 1 << 16)
+			except OSError: break
+			if not data: break
+
+			if b"\x1b[6n" in data:
+				os.write(fd, b"\x1b[%d;%dR" % (ROWS, COLS))
+
+			output += data
+
+		while script and script[0][0] <= time.time() - start:
+			action = script.pop(0)[1]
+
+			if isinstance(action, str):
+				os.write(fd, action.encode())
+			else:
+				resize(fd, *action)
+				os.kill(pid, signal.SIGWINCH)
+
+	try: os.kill(pid, signal.SIGKILL)
+	except ProcessLookupError: pass
+
+	os.waitpid(pid, 0)
+	return re.findall(rb"Score: (\d+)", output)
+
+def main():
+	with tempfile.TemporaryDirectory() as tmp:
+		record = os.path.join(tmp, "snake.rec")
+		live = play(record)
+
+		proc = subprocess.run([SNAKE, "-H", "-i", record],
+			stdout = subprocess.PIPE)
+		replay = re.findall(rb"Score: (\d+)", proc.stdout)
+
+	if not live: sys.exit("snake: the scripted game didn't finish")
+	live, replay = int(live[-1]), int(replay[-1]) if replay else None
+
+	print("snake: played to %d, replayed to %s" % (live, replay))
+	return 0 if live == replay else 1
+
+if __name__ == "__main__": sys.exit(main())
@@ -0,0 +1,60 @@
+/* Tiny C Benchmark Runner: Times a Program and Measures its Peak RSS
+ * Copyright (C) 2021-2023 Jyothiraditya Nellakra
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Runs a program with its output thrown away, and prints the seconds it took
+ * and its peak RSS in kilobytes. bench.py can't take the peak RSS itself, as a
+ * process counts the memory of whatever forked it, up to its exec(), towards
+ * its own peak, and Python's is bigger than most of the programs'. */
+
+int main(int argc, char **argv) {
+	struct timespec start, end; struct rusage usage; int status;
+
+	if(argc < 2) {
+		fprintf(stderr, "%s: usage: %s PROG [ARGS...]\n", argv[0],
+			argv[0]);
+
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t pid = fork();
+	if(pid == -1) { perror(argv[0]); return 1; }
+
+	if(!pid) {
+		int null = open("/dev/null", O_WRONLY);
+		if(null != -1) dup2(null, STDOUT_FILENO);
+
+		execv(argv[1], argv + 1);
+		perror(argv[1]); _exit(127);
+	}
+
+	if(wait4(pid, &status, 0, &usage) == -1) { perror(argv[0]); return 1; }
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = end.tv_sec - start.tv_sec
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%.9f %ld\n", secs, usage.ru_maxrss);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
@@ -15,86 +15,326 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. */
 
 #include <stdbool.h> //
-#include <stdio.h>   //          m      "
-#include <stdlib.h>  //        mm#mm  mmm    m mm   m   m          mmm
-#include <string.h>  //          #      #    #"  #  "m m"         #"  "
-#include <time.h>    //          #      #    #   #   #m#          #
-                     //          "mm  mm#mm  #   #   "#           "#mm"
-#include <fcntl.h>   //                              m"
-#include <termios.h> //                             ""
+#include <stdint.h>  //          m      "
+#include <stdio.h>   //        mm#mm  mmm    m mm   m   m          mmm
+#include <stdlib.h>  //          #      #    #"  #  "m m"         #"  "
+#include <string.h>  //          #      #    #   #   #m#          #
+#include <time.h>    //          "mm  mm#mm  #   #   "#           "#mm"
+                     //                              m"
+#include <errno.h>   //                             ""
+#include <fcntl.h>   //
+#include <poll.h>    //
+#include <pthread.h> //
+#include <signal.h>  //
+#include <termios.h> //
 #include <unistd.h>  //
 
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include "term.h"
+
 #define TITLE_L "Tiny Brain - Use WASD to Move, Space to Pause, Return to Exit"
 #define TITLE_R "RF to Alter Speed, UIO for Cell State, X to Reset, C to Clear"
 #define PROGRAM "Tiny Brain"
 #define CREDITS "Copyright (C) 2021-2022 Jyothiraditya Nellakra"
 
-#define FCNTL_SET_ERR "Error setting input to non-blocking with fcntl()."
-#define TCGETATTR_ERR "Error getting terminal properties with tcgetattr()."
-#define TCSETATTR_ERR "Error setting terminal properties with tcsetattr()."
-#define SCREEN_HW_ERR "Error getting screen size with ANSI escape codes."
 #define MEM_ALLOC_ERR "Error allocating memory with malloc()."
+#define PTHREAD_C_ERR "Error starting the simulation with pthread_create()."
+#define PTHREAD_W_ERR "Error starting checkpoints with pthread_create()."
+#define CKPT_LOAD_ERR "Error reading the checkpoint to resume from."
+#define CKPT_SAVE_ERR "Error writing the final checkpoint."
+#define REPLAY_ERR "Error reading the header of the file to replay."
+#define REPLAY_SIZE_ERR "Error replaying: the terminal isn't the recorded size."
+#define TIMER_ERR "Error creating a timer with timerfd_create()."
 #define NON_REACH_ERR "This error shouldn't trigger; main() shouldn't exit."
 
-struct termios cooked, raw;
-char *back_buf, *front_buf;
+#define OPTIONS "ts:c:C:l:o:i:H"
+#define USAGE_MSG "%s: usage: %s [-t] [-s FILE] [-c FILE] [-C SECS] " \
+	"[-l FILE] [-o FILE] [-i FILE [-H]].\n"
+#define FOPEN_MSG "%s: error: can't open file.\n"
+
+uint64_t *back_buf, *front_buf;
+char *text_buf, *shown_buf;
 ssize_t height, width;
+size_t words, plane;
 
-long delay = 41666667L;
-bool paused = false;
-ssize_t x, y;
+pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t unpaused = PTHREAD_COND_INITIALIZER;
+size_t generation, shown_generation = -1;
 
-void swap_bufs() { char *b = back_buf; back_buf = front_buf; front_buf = b; }
-void refresh_screen() { puts("\e[1;1H"); puts(front_buf); }
+long delay = 41666667L, frame = 16666667L;
+bool paused = false, show_stats = false;
+ssize_t x, y;
 
-void print_ch(char ch) { printf("\e[%zu;%zuH\e[7m%c\e[0m", y + 2, x + 1, ch); }
+void swap_bufs() {
+	uint64_t *b = back_buf; back_buf = front_buf; front_buf = b;
+}
 void print_spaces(size_t n) { for(size_t i = 0; i < n; i++) putchar(' '); }
 
-void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &cooked); }
-void pauseprg(long ns) { nanosleep((const struct timespec[]){{0, ns}}, NULL); }
-void exitprg(size_t ret) { reset_terminal(); printf("\e[?25h"); exit(ret); }
+void print_ch(char ch) { out_goto(x, y + 1); out_attr(7); out_put(&ch, 1); }
+
+/* The board is kept as two bit-planes of 64-cell words, one for firing cells
+ * and one for refractory cells, with each row padded out to a whole word.
+ * Characters only exist in text_buf, which is filled in when drawing. */
 
 char buf_get(ssize_t x, ssize_t y) {
-	x = x < 0 ? x + width : x >= width ? x - width : x;
-	y = y < 0 ? y + height : y >= height ? y - height : y;
+	size_t i = y * words + x / 64; uint64_t bit = 1ULL << x % 64;
+	if(front_buf[i] & bit) return '#';
+	return front_buf[plane + i] & bit ? '+' : ' ';
+}
+
+void front_buf_put(ssize_t x, ssize_t y, char ch) {
+	size_t i = y * words + x / 64; uint64_t bit = 1ULL << x % 64;
+	front_buf[i] &= ~bit; front_buf[plane + i] &= ~bit;
 
-	return front_buf[y * width + x];
+	if(ch == '#') front_buf[i] |= bit;
+	else if(ch == '+') front_buf[plane + i] |= bit;
 }
 
-void back_buf_put(ssize_t x, ssize_t y, char ch) {
-	back_buf[y * width + x] = ch;
+void print_title() {
+	if((unsigned) width < strlen(TITLE_L)) {
+		printf("\e[2J\e[H\e[7m%s", PROGRAM);
+		print_spaces(width - strlen(PROGRAM));
+		puts("\e[0m\e[?25l");
+	}
+	
+	else if((unsigned) width < strlen(TITLE_L) + strlen(TITLE_R) + 3) {
+		printf("\e[2J\e[H\e[7m%s", TITLE_L);
+		print_spaces(width - strlen(TITLE_L));
+		puts("\e[0m\e[?25l");
+	}
+
+	else {
+		printf("\e[2J\e[H\e[7m%s", TITLE_L);
+		print_spaces(width - strlen(TITLE_L) - strlen(TITLE_R));
+		printf("%s\e[0m\e[?25l", TITLE_R);
+	}
+
+	out_x = out_sgr = -1;
 }
 
-void front_buf_put(ssize_t x, ssize_t y, char ch) {
-	front_buf[y * width + x] = ch;
+void print_status() {
+	out_goto(0, 0); out_attr(7);
+	out_len += sprintf(out_buf + out_len, "%-*.*s", (int) width,
+		(int) width, status);
+
+	out_x = -1; status_stale = false;
 }
 
-size_t count_around(ssize_t x, ssize_t y) {
-	return (buf_get(x - 1, y - 1) == '#') + (buf_get(x, y - 1) == '#')
-	     + (buf_get(x + 1, y - 1) == '#') + (buf_get(x + 1, y) == '#')
-	     + (buf_get(x + 1, y + 1) == '#') + (buf_get(x, y + 1) == '#')
-	     + (buf_get(x - 1, y + 1) == '#') + (buf_get(x - 1, y) == '#');
+/* Changed cells are sent as cursor-addressed runs, with gaps shorter than a
+ * cursor move sent as-is. If that costs more than the whole board, the whole
+ * board is sent instead. The cell under the cursor is left marked as stale so
+ * that it's repainted without the highlight once the cursor moves off it. */
+
+#define MOVE_COST 10
+
+void refresh_screen() {
+	size_t full = height * width + 6;
+
+	for(ssize_t i = 0; i < height; i++) for(ssize_t j = 0; j < width; j++)
+		text_buf[i * width + j] = buf_get(j, i);
+
+	for(ssize_t i = 0; i < height; i++) for(ssize_t j = 0; j < width; j++) {
+		ssize_t k = i * width + j, end = k, stop = (i + 1) * width;
+		if(text_buf[k] == shown_buf[k]) continue;
+
+		for(ssize_t l = k + 1; l < stop && l - end <= MOVE_COST; l++)
+			if(text_buf[l] != shown_buf[l]) end = l;
+
+		if(out_len + MOVE_COST + end - k + 1 > full) goto redraw;
+		out_goto(j, i + 1); out_attr(0);
+		out_put(text_buf + k, end - k + 1); j += end - k;
+	}
+
+	goto cursor;
+redraw:	out_len = 0; out_x = out_sgr = -1;
+	out_goto(0, 1); out_attr(0); out_put(text_buf, height * width);
+
+cursor:	memcpy(shown_buf, text_buf, height * width);
+	print_ch(text_buf[y * width + x]); shown_buf[y * width + x] = 0;
+	if(show_stats && status_stale) print_status();
 }
 
-void next_generation() {
-	for(ssize_t x = 0; x < width; x++)
-		for(ssize_t y = 0; y < height; y++) {
+/* Neighbours to the west and east of a word's cells, wrapping around at the
+ * ends of the row. Bits past the end of the row pick up garbage here, which
+ * next_generation() masks off. */
+
+uint64_t west(const uint64_t *row, size_t w) {
+	uint64_t bits = row[w] << 1;
+	if(w) return bits | row[w - 1] >> 63;
+	return bits | (row[words - 1] >> (width - 1) % 64 & 1);
+}
+
+uint64_t east(const uint64_t *row, size_t w) {
+	uint64_t bits = row[w] >> 1;
+	if(w + 1 < words) return bits | row[w + 1] << 63;
+	return bits | (row[0] & 1) << (width - 1) % 64;
+}
 
-	switch(buf_get(x, y)) {
-		case '#': back_buf_put(x, y, '+'); break;
-		case '+': back_buf_put(x, y, ' '); break;
+/* Adds a bit to each of 64 bit-sliced counters at once. fours is sticky, so
+ * the counter tops out at "four or more", which is all the rule needs. */
 
-	case ' ':
-		if(count_around(x, y) == 2) back_buf_put(x, y, '#');
-		else back_buf_put(x, y, ' ');
+void count_in(uint64_t in, uint64_t *ones, uint64_t *twos, uint64_t *fours) {
+	uint64_t carry = *ones & in; *ones ^= in;
+	*fours |= *twos & carry; *twos ^= carry;
+}
+
+void next_generation() {
+	uint64_t tail = ~0ULL >> (63 - (width - 1) % 64);
+
+	for(ssize_t y = 0; y < height; y++) {
+		ssize_t above = y ? y - 1 : height - 1;
+		ssize_t below = y + 1 < height ? y + 1 : 0;
+
+		uint64_t *up = front_buf + above * words;
+		uint64_t *row = front_buf + y * words;
+		uint64_t *down = front_buf + below * words;
+
+	for(size_t w = 0; w < words; w++) {
+		uint64_t ones = 0, twos = 0, fours = 0;
+
+		count_in(west(up, w), &ones, &twos, &fours);
+		count_in(up[w], &ones, &twos, &fours);
+		count_in(east(up, w), &ones, &twos, &fours);
+		count_in(west(row, w), &ones, &twos, &fours);
+		count_in(east(row, w), &ones, &twos, &fours);
+		count_in(west(down, w), &ones, &twos, &fours);
+		count_in(down[w], &ones, &twos, &fours);
+		count_in(east(down, w), &ones, &twos, &fours);
+
+		uint64_t firing = row[w], resting = row[plane + w];
+		uint64_t ready = ~(firing | resting);
+		if(w + 1 == words) ready &= tail;
+
+		back_buf[y * words + w] = ready & ~ones & twos & ~fours;
+		back_buf[plane + y * words + w] = firing;
 	}}
 
 	swap_bufs();
-	refresh_screen();
 }
 
-int main_loop() {
-	switch(getchar()) {
+char get_cell(size_t x, size_t y) { return buf_get(x, y); }
+void put_cell(size_t x, size_t y, char ch) { front_buf_put(x, y, ch); }
+
+/* The board is advanced on its own thread, a generation each time sim_fd
+ * fires, holding buf_lock only while it computes one. The timer is set going
+ * again whenever delay changes, or after a pause or a replayed key has held
+ * the board up, so that the next generation comes a whole delay later. The
+ * main thread takes the lock to apply key presses and to diff the latest
+ * generation against the screen, but writes the frame out after releasing it,
+ * so a slow terminal holds up the display without holding up the simulation. */
+
+/* With -o, each key is logged along with how many generations have passed
+ * since the last one, after a line giving the seed and the size of the
+ * board. Generations are logged rather than times so that -i can apply the
+ * keys to exactly the same generations: the simulation waits at any that has
+ * a key due until the main thread has applied it. With -H as well, the replay
+ * runs with no terminal and no delay between generations. A key of zero marks
+ * where the run ended; when a replay runs out, the keyboard takes over again,
+ * or with -H, the run ends there. A run resumed with -l needs the same
+ * checkpoint to replay. */
+
+unsigned seed;
+
+/* When the terminal is resized, the board is cropped or padded with dead
+ * cells to fit, keeping the top left corner where it was, as with a
+ * checkpoint from a differently sized terminal. Rows are copied a word at a
+ * time, with the bits past the new end of the row masked off. The buffers
+ * are only ever grown, so shrinking and growing back again doesn't
+ * reallocate anything. Any checkpoint being written is waited for before its
+ * buffers move. With -o or -i, the board stays the size it started at, so
+ * that replays stay exact. */
+
+size_t board_cap, text_cap, out_cap;
+
+void *grow(void *buf, size_t size) {
+	if(!(buf = realloc(buf, size))) { puts(MEM_ALLOC_ERR); exitprg(5); }
+	return buf;
+}
+
+void resize_board() {
+	int w, h;
+	if(!term_size(&h, &w)) return;
+
+	h -= 2;
+	if(w < 1 || h < 1 || (w == width && h == height)) return;
+	if(record_file || replay_file) return;
+
+	size_t cells = w * h, out_size = cells + w + 64;
+	size_t row = (w + 63) / 64, size = h * row;
+	uint64_t tail = ~0ULL >> (63 - (w - 1) % 64);
+
+	if(2 * size > board_cap) {
+		board_cap = 2 * size;
+		front_buf = grow(front_buf, sizeof(uint64_t) * board_cap);
+		back_buf = grow(back_buf, sizeof(uint64_t) * board_cap);
+	}
+
+	if(cells > text_cap) {
+		text_cap = cells;
+		text_buf = grow(text_buf, text_cap);
+		shown_buf = grow(shown_buf, text_cap);
+	}
+
+	if(out_size > out_cap) out_buf = grow(out_buf, out_cap = out_size);
+	memset(back_buf, 0, sizeof(uint64_t) * 2 * size);
+
+	for(size_t p = 0; p < 2; p++)
+	for(ssize_t j = 0; j < h && j < height; j++) {
+		uint64_t *from = front_buf + p * plane + j * words;
+		uint64_t *to = back_buf + p * size + j * row;
+
+		size_t n = row < words ? row : words;
+		memcpy(to, from, sizeof(uint64_t) * n); to[row - 1] &= tail;
+	}
+
+	swap_bufs(); out_cols = width = w; height = h;
+	words = row; plane = size;
+	if(x >= width) x = width - 1;
+	if(y >= height) y = height - 1;
+
+	if(ckpt_name && !ckpt_resize(cells)) {
+		puts(MEM_ALLOC_ERR); exitprg(5);
+	}
+}
+
+int sim_fd; long sim_ns;
+
+void *sim_loop(void *arg) {
+	struct pollfd in = {sim_fd, POLLIN, 0};
+	uint64_t ticks;
+
+	while(true) {
+		pthread_mutex_lock(&buf_lock);
+		while(paused || replay_due(generation)) {
+			pthread_cond_wait(&unpaused, &buf_lock);
+			sim_ns = 0;
+		}
+
+		long long start = clock_ns();
+		next_generation(); generation++;
+		stats_add(&compute_stats, clock_ns() - start);
+		ckpt_start(generation, width, height);
+
+		if(sim_ns != delay) {
+			struct timespec t = {delay / 1000000000,
+				delay % 1000000000};
+
+			struct itimerspec it = {t, t}; sim_ns = delay;
+			timerfd_settime(sim_fd, 0, &it, NULL);
+		}
+
+		pthread_mutex_unlock(&buf_lock);
+		while(read(sim_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+			poll(&in, 1, -1);
+	}
+
+	return arg;
+}
+
+int handle_key(int ch) {
+	switch(ch) {
 		case 'w': if(y > 0) { y--; } break;
 		case 'a': if(x > 0) { x--; } break;
 		case 's': if(y < height - 1) { y++; } break;
@@ -104,95 +344,269 @@ int main_loop() {
 		case 'i': front_buf_put(x, y, '+'); break;
 		case 'o': front_buf_put(x, y, ' '); break;
 
-		case ' ': paused = paused ? false : true; goto wait;
+		case ' ': paused = paused ? false : true; break;
 		case 'r': delay -= delay / 10; break;
 		case 'f': delay += delay / 10; break;
-		case '\n': return 0;
+		case '\n': case 0: return 0;
 
-	case 'c':
-		for(size_t i = 0; i < (unsigned) (width * height); i++)
-			front_buf[i] = ' ';
+	case 't':
+		show_stats = show_stats ? false : true; status_stale = true;
+		if(show_stats) break;
+
+		if(!headless) print_title();
+		memset(shown_buf, 0, height * width);
+		break;
 
-		goto redisp;
+	case 'c':
+		memset(front_buf, 0, sizeof(uint64_t) * 2 * plane);
+		break;
 
 	case 'x':
-		for(size_t i = 0; i < (unsigned) (height * width); i++) {
+		for(ssize_t i = 0; i < height * width; i++) {
 			
 		switch(rand() % 3) {
-			case 0: front_buf[i] = ' '; break;
-			case 1: front_buf[i] = '+'; break;
-			case 2: front_buf[i] = '#';
+			case 0: front_buf_put(i % width, i / width, ' '); break;
+			case 1: front_buf_put(i % width, i / width, '+'); break;
+			case 2: front_buf_put(i % width, i / width, '#');
 		}}
 
-	redisp:	if(paused) refresh_screen(); break;
-	wait:	if(paused) fcntl(STDIN_FILENO, F_SETFL, ~O_NONBLOCK);
-		else fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+		break;
 	}
 
-	if(!paused) next_generation();
-	print_ch(buf_get(x, y));
-	fflush(stdout);
+	pthread_cond_signal(&unpaused);
 	return 1;
 }
 
-int main() {
-	int ret = fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-	if(ret == -1) { puts(FCNTL_SET_ERR); exit(1); }
+void send_frame(long long start) {
+	if(!out_len) return;
+
+	long long mid = clock_ns();
+	stats_add(&render_stats, mid - start);
+
+	stats_frame(out_len);
+
+	if(!flush_out()) { puts(WRITE_SYS_ERR); exitprg(7); }
+	stats_add(&output_stats, clock_ns() - mid);
+}
+
+/* The main thread sleeps in poll() until a key arrives or the frame timer
+ * fires, so keys are seen as soon as they're pressed. While paused, only a key
+ * can wake it, so a paused board uses no CPU at all. */
+
+int frame_fd;
+
+void wait_event() {
+	struct pollfd in[] = {{STDIN_FILENO, POLLIN, 0}, {frame_fd, POLLIN, 0}};
+	uint64_t ticks;
+
+	if(replay_due(generation)) return;
+	poll(in, paused ? 1 : 2, -1);
+	while(read(frame_fd, &ticks, sizeof(ticks)) > 0);
+}
+
+int main_loop() {
+	wait_event();
+
+	pthread_mutex_lock(&buf_lock);
+	bool changed = generation != shown_generation;
+	int ret = 1, ch;
 
-	ret = tcgetattr(STDIN_FILENO, &cooked);
-	if(ret == -1) { puts(TCGETATTR_ERR); exit(2); }
+	for(; ret && replay_due(generation); replay_next()) {
+		record_key(generation, next_key);
+		ret = handle_key(next_key); changed = true;
+	}
 
-	raw = cooked;
-	raw.c_lflag &= ~(ICANON | ECHO);
+	while(ret && (ch = getchar()) != EOF) {
+		if(next_key != EOF && ch != '\n') continue;
+		record_key(generation, ch);
+		ret = handle_key(ch); changed = true;
+	}
 
-	ret = tcsetattr(STDIN_FILENO, TCSANOW, &raw);
-	if(ret == -1) { puts(TCSETATTR_ERR); exit(3); }
+	if(resized) {
+		resize_board(); print_title();
+		memset(shown_buf, 0, height * width);
+		resized = 0; status_stale = changed = true;
+	}
 
-	printf("\e[999;999H\e[6n");
-	while(getchar() != '\e');
+	long long start = clock_ns();
+	update_status(generation, "gen/s", 1e9 / delay);
 
-	ret = scanf("[%zd;%zdR", &height, &width); height -= 2;
-	if(ret != 2) { puts(SCREEN_HW_ERR); exitprg(4); }
+	if(ret && changed) { refresh_screen(); shown_generation = generation; }
+	pthread_mutex_unlock(&buf_lock);
+
+	send_frame(start); return ret;
+}
 
-	front_buf = malloc(sizeof(char) * height * width + 1);
+int replay_loop() {
+	int ret = 1;
+
+	for(; ret && replay_due(generation); replay_next()) {
+		record_key(generation, next_key); ret = handle_key(next_key);
+	}
+
+	if(!ret || next_key == EOF || paused) return 0;
+
+	long long start = clock_ns();
+	next_generation(); generation++;
+	stats_add(&compute_stats, clock_ns() - start);
+	ckpt_start(generation, width, height);
+
+	start = clock_ns();
+	update_status(generation, "gen/s", 1e9 / delay);
+	refresh_screen(); send_frame(start);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	seed = time(NULL);
+
+	for(int opt; (opt = getopt(argc, argv, OPTIONS)) != -1;) switch(opt) {
+		case 't': show_stats = true; break;
+		case 'c': ckpt_name = optarg; break;
+		case 'H': headless = true; break;
+
+	case 's':
+		stats_file = fopen(optarg, "w");
+		if(!stats_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
+
+	case 'C':
+		ckpt_period = atof(optarg) * 1e9;
+		if(ckpt_period > 0) break;
+
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
+
+	case 'l':
+		load_file = fopen(optarg, "rb");
+		if(!load_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
+
+	case 'o':
+		record_file = fopen(optarg, "w");
+		if(!record_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
+
+	case 'i':
+		replay_file = fopen(optarg, "r");
+		if(!replay_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
+
+	default:
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
+	}
+
+	if(headless && !replay_file) {
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
+	}
+
+	ssize_t size[2];
+	if(replay_file) {
+		int ret = fscanf(replay_file, "brain %u %zd %zd", &seed,
+			&size[0], &size[1]);
+
+		if(ret != 3 || size[0] < 1 || size[1] < 1) {
+			puts(REPLAY_ERR); exit(13);
+		}
+	}
+
+	if(headless) { width = size[0]; height = size[1]; goto start; }
+
+	int rows, cols, ret = term_open(&rows, &cols);
+	if(ret) exit(ret);
+
+	height = rows - 2; width = cols;
+
+	if(replay_file && (width != size[0] || height != size[1])) {
+		puts(REPLAY_SIZE_ERR); exitprg(14);
+	}
+
+start:	words = (width + 63) / 64; plane = height * words;
+	board_cap = 2 * plane; text_cap = height * width;
+	out_cols = width; out_cap = (height + 1) * width + 64;
+
+	front_buf = calloc(board_cap, sizeof(uint64_t));
 	if(!front_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	back_buf = malloc(sizeof(char) * height * width + 1);
+	back_buf = calloc(board_cap, sizeof(uint64_t));
 	if(!back_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	srand((unsigned) time(NULL));
+	text_buf = malloc(sizeof(char) * text_cap);
+	if(!text_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	shown_buf = calloc(text_cap, sizeof(char));
+	if(!shown_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	out_buf = malloc(sizeof(char) * out_cap);
+	if(!out_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	for(size_t i = 0; i < (unsigned) (height * width); i++) {
+	srand(seed);
+
+	for(ssize_t i = 0; i < height * width; i++) {
 		switch(rand() % 3) {
-			case 0: front_buf[i] = ' '; break;
-			case 1: front_buf[i] = '+'; break;
-			case 2: front_buf[i] = '#';
+			case 0: front_buf_put(i % width, i / width, ' '); break;
+			case 1: front_buf_put(i % width, i / width, '+'); break;
+			case 2: front_buf_put(i % width, i / width, '#');
 		}
 	}
 
-	front_buf[height * width] = 0;
+	ckpt_magic = "tiny-brain-1"; ckpt_cells = "#+";
+	ckpt_get = get_cell; ckpt_put = put_cell;
 
-	if((unsigned) width < strlen(TITLE_L)) {
-		printf("\e[2J\e[H\e[7m%s", PROGRAM);
-		print_spaces(width - strlen(PROGRAM));
-		puts("\e[0m\e[?25l");
+	if(load_file && !ckpt_load(&generation, width, height)) {
+		puts(CKPT_LOAD_ERR); exitprg(11);
 	}
-	
-	else if((unsigned) width < strlen(TITLE_L) + strlen(TITLE_R) + 3) {
-		printf("\e[2J\e[H\e[7m%s", TITLE_L);
-		print_spaces(width - strlen(TITLE_L));
-		puts("\e[0m\e[?25l");
+
+	last_step = next_step = generation;
+
+	if(replay_file) replay_next();
+	if(record_file) {
+		setvbuf(record_file, NULL, _IOLBF, 0);
+		fprintf(record_file, "brain %u %zd %zd\n", seed, width, height);
 	}
 
+	if(!ckpt_resize(height * width)) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	if(!headless) { print_title(); signal(SIGWINCH, on_resize); }
+	start_ns = last_ns = ckpt_last = clock_ns();
+
+	/* Resizes go to the main thread, so that they cut its poll() short. */
+	sigset_t winch; sigemptyset(&winch); sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch, NULL);
+
+	pthread_t sim, writer;
+	ret = ckpt_name ? pthread_create(&writer, NULL, ckpt_writer, NULL) : 0;
+	if(ret) { puts(PTHREAD_W_ERR); exitprg(8); }
+
+	if(!headless) {
+		sim_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if(sim_fd == -1) { puts(TIMER_ERR); exitprg(15); }
+	}
+
+	ret = headless ? 0 : pthread_create(&sim, NULL, sim_loop, NULL);
+	if(ret) { puts(PTHREAD_C_ERR); exitprg(8); }
+	pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+
+	if(headless) while(replay_loop());
 	else {
-		printf("\e[2J\e[H\e[7m%s", TITLE_L);
-		print_spaces(width - strlen(TITLE_L) - strlen(TITLE_R));
-		printf("%s\e[0m\e[?25l", TITLE_R);
+		frame_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if(frame_fd == -1) { puts(TIMER_ERR); exitprg(15); }
+
+		struct timespec t = {0, frame};
+		timerfd_settime(frame_fd, 0, &(struct itimerspec) {t, t}, NULL);
+		while(main_loop());
 	}
 
-	refresh_screen();
-	while(main_loop()) pauseprg(delay);
+	pthread_mutex_lock(&buf_lock);
+	bool saved = ckpt_finish(generation, width, height);
+	record_key(generation, 0);
+
+	if(!headless) printf("\e[2J\e[H");
+	else printf("Replayed %zu generations in %.3f s.\n", generation,
+		(clock_ns() - start_ns) / 1e9);
+
+	printf("%s %s\n", PROGRAM, CREDITS);
 
-	printf("\e[2J\e[H%s %s\n", PROGRAM, CREDITS);
+	if(!saved) { puts(CKPT_SAVE_ERR); exitprg(12); }
+	dump_stats("brain", "generations", generation, 1e9 / delay);
 	exitprg(0);
 }
\ No newline at end of file
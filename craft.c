@@ -14,6 +14,7 @@
  * You should have received a copy of the GNU General Public License along with
  * this program. If not, see <https://www.gnu.org/licenses/>. */
 
+#include <errno.h>    //
 #include <inttypes.h> //
 #include <math.h>     //
 #include <stdbool.h>  //         m      "
@@ -23,110 +24,316 @@
 #include <time.h>     //         "mm  mm#mm  #   #   "#           "#mm"
 		      //                             m"
 #include <fcntl.h>    //                            ""
+#include <poll.h>     //
+#include <pthread.h>  //
+#include <signal.h>   //
 #include <termios.h>  //
 #include <unistd.h>   //
 
+#include <sys/ioctl.h>
+
+#include "term.h"
+
 /* ========================== Global Declarations ========================== */
 
 typedef struct { double x, y, z; } vec_t;
 
-const int K_FCNTL_SET_ERR = 1, K_TCGETATTR_ERR = 2, K_TCSETATTR_ERR = 3;
-const int K_SCREEN_HW_ERR = 4, K_MEM_ALLOC_ERR = 5, K_WRITE_SYS_ERR = 6;
+/* Exit codes 1 to 4 are term_open()'s, as they are in every program. */
+const int K_MEM_ALLOC_ERR = 5, K_WRITE_SYS_ERR = 6;
+const int K_USAGE_ERR = 7, K_FOPEN_ERR = 8, K_PTHREAD_ERR = 9;
+const int K_REPLAY_ERR = 10, K_REPLAY_SIZE_ERR = 11;
+
+long long K_frame = 16666667LL;
+
+unsigned K_seed;
+bool K_headless;
 
 int main(int argc, char **argv);
 void K_panic(int error);
 void K_exit();
 
-struct termios C_raw, C_cooked;
-int C_flags;
-
 size_t C_height, C_width, C_max_render = 16;
 
-typedef struct __attribute__((packed)) {
-	char fg_header[7], fg_value[3], fg_post;
-	char bg_header[7], bg_value[3], bg_post;
-	char value;
-
-} C_cell_t;
+typedef struct { unsigned char colour; char value; } C_cell_t;
 
-C_cell_t *C_buffer;
+C_cell_t *C_buffer, *C_shown;
+char C_codes[216][3], *C_output;
 
-double *C_rvalue, *C_gvalue, *C_bvalue, *C_zvalue;
+unsigned char *C_colour;
+float *C_depth, *C_tile_depth;
 char *C_cvalue;
 
+#define C_TILE 8
+size_t C_tiles_x, C_tiles_y;
+
+typedef struct { vec_t points[3], colour; char ch; bool line; } C_prim_t;
+typedef struct { size_t *prims, count, max_prims, len; } C_band_t;
+
+C_prim_t *C_prims;
+size_t C_prim_count, C_max_prims;
+
+C_band_t *C_bands;
+size_t C_row_bytes, C_workers;
+size_t C_max_cells, C_max_output, C_max_tiles, C_max_bands;
+
+pthread_mutex_t C_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t C_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t C_done = PTHREAD_COND_INITIALIZER;
+size_t C_frame, C_next_band, C_bands_done;
+
 void C_initialise();
 void C_reset();
 
-void C_draw_line(vec_t start, vec_t end, vec_t colour);
+void C_add_line(vec_t start, vec_t end, vec_t colour);
+void C_add_triangle(vec_t a, vec_t b, vec_t c, char ch, vec_t colour);
 
 void C_render();
+void C_repaint();
+bool C_resize();
+void C_draw_header();
+void C_write(const void *data, size_t len);
+
+typedef struct { vec_t position; double yaw, pitch, fov; } G_camera_t;
+typedef struct { size_t start, end; vec_t colour; } G_line_t;
+typedef struct { size_t vertices[4]; char ch; vec_t colour; } G_face_t;
+
+G_camera_t G_camera = {{0.5, 0.5, -12.0}, 0.0, -30.0, 90.0};
+
+float *G_wx, *G_wy, *G_wz, *G_cx, *G_cy, *G_cz;
+size_t G_vertices, G_max_vertices;
+
+G_line_t *G_lines;
+size_t G_line_count, G_max_lines;
+
+G_face_t *G_faces;
+size_t G_face_count, G_max_faces;
+
+bool G_key(int ch);
+vec_t G_forward();
+size_t G_add_vertex(vec_t vertex);
+void G_add_line(size_t start, size_t end, vec_t colour);
+void G_add_face(size_t vertices[4], char ch, vec_t colour);
+void G_flush();
+
+size_t S_dropped;
+bool S_shown;
+
+void S_update();
+void S_toggle();
+void S_dump();
+
+#define W_SHIFT 4
+#define W_SIZE (1 << W_SHIFT)
+#define W_VOLUME (W_SIZE * W_SIZE * W_SIZE)
+#define W_TOP -1
+#define W_BOTTOM 0
+
+typedef enum { W_AIR, W_GRASS, W_DIRT, W_STONE } W_block_t;
+typedef struct { float x[4], y[4], z[4]; unsigned char block, face; } W_quad_t;
+
+typedef struct {
+	int x, y, z; unsigned char blocks[W_VOLUME];
+	W_quad_t *quads; size_t quad_count, max_quads; bool dirty;
+} W_chunk_t;
+
+typedef struct { int x, y, z, face, block; } W_hit_t;
+
+W_chunk_t *W_chunks;
+int *W_table;
+
+size_t W_chunk_count, W_max_chunks, W_table_size;
+int W_radius, W_centre_x, W_centre_y;
+unsigned W_seed;
+int W_selected = W_GRASS;
+
+void W_initialise();
+W_chunk_t *W_find(int x, int y, int z);
+int W_get_block(int x, int y, int z);
+void W_set_block(int x, int y, int z, int block);
+bool W_pick(vec_t origin, vec_t direction, double range, W_hit_t *hit);
+bool W_key(int ch);
+void W_update(vec_t position);
+void W_draw();
 
 /* ============================== Kernel Code ============================== */
 
-#define K_FCNTL_SET_MSG "Error setting input to non-blocking with fcntl()."
-#define K_TCGETATTR_MSG "Error getting terminal properties with tcgetattr()."
-#define K_TCSETATTR_MSG "Error setting terminal properties with tcsetattr()."
-#define K_SCREEN_HW_MSG "Error getting screen size with ANSI escape codes."
 #define K_MEM_ALLOC_MSG "Error allocating memory with malloc()."
-#define K_WRITE_SYS_MSG "Error writing using the write() system call."
+#define K_USAGE_MSG "Usage: craft [-t] [-s FILE] [-f FPS] [-o FILE] " \
+	"[-i FILE [-H]]."
+#define K_FOPEN_MSG "Error opening a file with fopen()."
+#define K_PTHREAD_MSG "Error starting render workers with pthread_create()."
+#define K_REPLAY_MSG "Error reading the header of the file to replay."
+#define K_REPLAY_SIZE_MSG "Error replaying at a different screen size."
+
+/* With -o, each key is logged along with how many frames have been drawn
+ * since the last one, after a line giving the seed and the size of the
+ * screen. The world only changes on keys, and a frame is only drawn when
+ * something has changed or the statistics are up, so -i feeding the keys
+ * back before the same frames replays the session exactly. With -H as well,
+ * the frames are still rendered, but with no terminal to write them to and no
+ * waiting between them. A key of zero marks where the session ended; when a
+ * replay runs out, the keyboard takes over again, or with -H, it ends there. */
+
+bool _key(int ch) {
+	record_key(frames, ch);
+	if(ch == '\n' || !ch) K_exit();
+	if(ch == 't') { S_toggle(); return true; }
+	return G_key(ch) || W_key(ch);
+}
+
+void _draw_frame() {
+	long long start = clock_ns();
+	C_reset();
+
+	W_update(G_camera.position);
+	W_draw(); G_flush();
+
+	stats_add(&compute_stats, clock_ns() - start);
+	C_render();
+}
+
+void _replay(bool changed) {
+	while(true) {
+		for(; replay_due(frames); replay_next())
+			changed = _key(next_key) || changed;
+		if(next_key == EOF || !(changed || S_shown)) K_exit();
+
+		_draw_frame(); changed = false;
+	}
+}
+
+/* Frames are due every K_frame nanoseconds. Between them the loop sleeps in
+ * poll(), waking early only to take in keys as they come, and a frame is only
+ * drawn if something's changed (or the statistics are up, so that they keep
+ * counting). With nothing to draw it waits on the keyboard alone. A frame
+ * that runs past the next one's time, usually because the terminal's behind
+ * and C_write() had to wait, has the frames it overran dropped rather than
+ * rushed out late. */
 
 int main(int argc, char **argv) {
-	(void) argc;
-	(void) argv;
+	K_seed = time(NULL);
+
+	const char *opts = "ts:f:o:i:H";
+	for(int opt; (opt = getopt(argc, argv, opts)) != -1;) switch(opt) {
+		case 't': S_shown = true; break;
+		case 'H': K_headless = true; break;
+
+	case 's':
+		stats_file = fopen(optarg, "w");
+		if(!stats_file) K_panic(K_FOPEN_ERR);
+		break;
+
+	case 'f':
+		if(!(atof(optarg) > 0.0)) K_panic(K_USAGE_ERR);
+		K_frame = 1e9 / atof(optarg);
+		break;
+
+	case 'o':
+		record_file = fopen(optarg, "w");
+		if(!record_file) K_panic(K_FOPEN_ERR);
+		break;
+
+	case 'i':
+		replay_file = fopen(optarg, "r");
+		if(!replay_file) K_panic(K_FOPEN_ERR);
+		break;
+
+	default:
+		K_panic(K_USAGE_ERR);
+	}
+
+	if(K_headless && !replay_file) K_panic(K_USAGE_ERR);
+
+	size_t width = 0, height = 0;
+	if(replay_file) {
+		int ret = fscanf(replay_file, "craft %u %zu %zu", &K_seed,
+			&width, &height);
+
+		if(ret != 3 || !width || !height) K_panic(K_REPLAY_ERR);
+
+		replay_next();
+		if(K_headless) { C_width = width; C_height = height; }
+	}
 
 	C_initialise();
-	srand((unsigned) time(NULL));
+	if(replay_file && (C_width != width || C_height != height))
+		K_panic(K_REPLAY_SIZE_ERR);
 
-	vec_t a, b, c, d, colour;
+	if(record_file) {
+		setvbuf(record_file, NULL, _IOLBF, 0);
+		fprintf(record_file, "craft %u %zu %zu\n", K_seed, C_width,
+			C_height);
+	}
 
-	a.x = -1; a.z = -1;
-	b.x = -1; b.z = 1;
-	c.x = 1; c.z = -1;
-	d.x = 1; d.z = 1;
+	srand(K_seed);
+	W_initialise();
 
-	while(getchar() != ' ') for(double j = 1.0; j > 0 ; j -= 0.1) {
-		C_reset();
+	struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+	start_ns = last_ns = clock_ns();
 
-		for(double i = 1 + j; i < C_max_render + j; i++) {
-			a.y = b.y = c.y = d.y = i;
+	long long next = start_ns;
+	bool changed = true;
+	if(K_headless) _replay(changed);
 
-			colour.x = rand() / (double) RAND_MAX;
-			colour.y = rand() / (double) RAND_MAX;
-			colour.z = rand() / (double) RAND_MAX;
+	while(true) {
+		long long wait = (next - clock_ns() + 999999) / 1000000;
 
-			C_draw_line(a, b, colour);
-			C_draw_line(b, d, colour);
-			C_draw_line(d, c, colour);
-			C_draw_line(c, a, colour);
+		if(!changed && !S_shown && next_key == EOF) {
+			poll(&in, 1, -1); next = clock_ns();
 		}
 
-		C_render();
-	}
+		else if(wait > 0) poll(&in, 1, wait);
+		if(resized) changed = C_resize() || changed;
+
+		for(int ch = getchar(); ch != EOF; ch = getchar()) {
+			if(next_key != EOF && ch != '\n') continue;
+			changed = _key(ch) || changed;
+		}
+
+		if(clock_ns() < next) continue;
+		for(; replay_due(frames); replay_next())
+			changed = _key(next_key) || changed;
 
-	K_exit();
+		if(changed || S_shown) { _draw_frame(); changed = false; }
+
+		next += K_frame;
+		long long now = clock_ns();
+		if(now < next) continue;
+
+		long long late = (now - next) / K_frame + 1;
+		S_dropped += late; next += late * K_frame;
+	}
 }
 
 void K_panic(int error) {
 	switch(error) {
-		case K_FCNTL_SET_ERR: puts(K_FCNTL_SET_MSG); break;
+		case K_USAGE_ERR: puts(K_USAGE_MSG); break;
+		case K_FOPEN_ERR: puts(K_FOPEN_MSG); break;
+		case K_REPLAY_ERR: puts(K_REPLAY_MSG); break;
 
-		case K_TCGETATTR_ERR: puts(K_TCGETATTR_MSG); goto cl2;
-		case K_TCSETATTR_ERR: puts(K_TCSETATTR_MSG); goto cl2;
+		case K_MEM_ALLOC_ERR: puts(K_MEM_ALLOC_MSG); goto reset;
+		case K_WRITE_SYS_ERR: puts(WRITE_SYS_ERR); goto reset;
+		case K_PTHREAD_ERR: puts(K_PTHREAD_MSG); goto reset;
+		case K_REPLAY_SIZE_ERR: puts(K_REPLAY_SIZE_MSG); goto reset;
 
-		case K_SCREEN_HW_ERR: puts(K_SCREEN_HW_MSG); goto cl1;
-		case K_MEM_ALLOC_ERR: puts(K_MEM_ALLOC_MSG); goto cl1;
-		case K_WRITE_SYS_ERR: puts(K_WRITE_SYS_MSG); goto cl1;
-
-	cl1:	fcntl(STDIN_FILENO, F_SETFL, C_flags | O_NONBLOCK);
-	cl2:	tcsetattr(STDIN_FILENO, TCSANOW, &C_cooked);
+	reset:	if(!K_headless) reset_terminal();
 	}
 
 	exit(error);
 }
 
 void K_exit() {
-	fcntl(STDIN_FILENO, F_SETFL, C_flags | O_NONBLOCK);
-	tcsetattr(STDIN_FILENO, TCSANOW, &C_cooked);
+	record_key(frames, 0);
+	S_dump();
+
+	if(K_headless) {
+		printf("Replayed %zu frames in %.3f s.\n", frames,
+			(clock_ns() - start_ns) / 1e9);
+
+		exit(0);
+	}
+
+	reset_terminal();
 	exit(0);
 }
 
@@ -138,57 +345,67 @@ void K_exit() {
 #define C_PROG_NAME "Tiny Craft"
 #define C_COPYRIGHT "Copyright (C) 2021-2022 Jyothiraditya Nellakra"
 
+void *_worker(void *arg);
+
 void _put_spaces(size_t n) { for(size_t i = 0; i < n; i++) putchar(' '); }
 
 void C_initialise() {
-	C_flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-	int ret = fcntl(STDIN_FILENO, F_SETFL, C_flags | O_NONBLOCK);
-	if(ret == -1) K_panic(K_FCNTL_SET_ERR);
-
-	ret = tcgetattr(STDIN_FILENO, &C_cooked);
-	if(ret == -1) K_panic(K_TCGETATTR_ERR);
-
-	C_raw = C_cooked;
-	C_raw.c_lflag &= ~(ICANON | ECHO);
-
-	ret = tcsetattr(STDIN_FILENO, TCSANOW, &C_raw);
-	if(ret == -1) K_panic(K_TCSETATTR_ERR);
-
-	printf("\e[999;999H\e[6n");
-	while(getchar() != '\e');
-
-	ret = scanf("[%zu;%zuR", &C_height, &C_width); C_height -= 2;
-	if(ret != 2) K_panic(K_SCREEN_HW_ERR);
-
-	C_buffer = malloc(sizeof(C_cell_t) * C_height * C_width);
-	C_cvalue = malloc(sizeof(char) * C_height * C_width);
-
-	C_rvalue = malloc(sizeof(double) * C_height * C_width);
-	C_gvalue = malloc(sizeof(double) * C_height * C_width);
-	C_bvalue = malloc(sizeof(double) * C_height * C_width);
-	C_zvalue = malloc(sizeof(double) * C_height * C_width);
-
-	if(!C_cvalue || !C_buffer || !C_rvalue
-	|| !C_gvalue || !C_bvalue || !C_zvalue)
+	if(K_headless) goto allocate;
+
+	int rows, cols, ret = term_open(&rows, &cols);
+	if(ret) exit(ret);
+
+	C_height = rows - 2; C_width = cols;
+
+allocate:
+	C_max_cells = C_height * C_width;
+	C_buffer = malloc(sizeof(C_cell_t) * C_max_cells);
+	C_shown = malloc(sizeof(C_cell_t) * C_max_cells);
+	C_row_bytes = C_width * 23 + 16;
+	C_max_output = C_height * C_row_bytes;
+	C_output = malloc(sizeof(char) * C_max_output);
+	C_cvalue = malloc(sizeof(char) * C_max_cells);
+	C_colour = malloc(sizeof(char) * C_max_cells);
+	C_depth = malloc(sizeof(float) * C_max_cells);
+
+	C_tiles_x = (C_width + C_TILE - 1) / C_TILE;
+	C_max_bands = C_tiles_y = (C_height + C_TILE - 1) / C_TILE;
+	C_max_tiles = C_tiles_x * C_tiles_y;
+	C_tile_depth = malloc(sizeof(float) * C_max_tiles);
+	C_bands = calloc(C_tiles_y, sizeof(C_band_t));
+
+	if(!C_cvalue || !C_buffer || !C_shown || !C_output || !C_colour
+	|| !C_depth || !C_tile_depth || !C_bands)
 		K_panic(K_MEM_ALLOC_ERR);
 
-	for(size_t i = 0; i < C_height; i++)
-		for(size_t j = 0; j < C_width; j++)
-	{
-		size_t offset = i * C_width + j;
+	for(int i = 0; i < 216; i++) {
+		char buffer[16]; sprintf(buffer, "%03d", i + 16);
+		memcpy(C_codes[i], buffer, 3);
+	}
 
-		memcpy(C_buffer[offset].fg_header, "\e[38;5;", 7);
-		memcpy(C_buffer[offset].fg_value, "015", 3);
-		C_buffer[offset].fg_post = 'm';
+	C_reset();
+	C_draw_header();
+	fflush(stdout);
 
-		memcpy(C_buffer[offset].bg_header, "\e[48;5;", 7);
-		memcpy(C_buffer[offset].bg_value, "000", 3);
-		C_buffer[offset].bg_post = 'm';
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	C_workers = cpus > 1 ? cpus - 1 : 0;
+	if(C_workers > C_tiles_y - 1) C_workers = C_tiles_y - 1;
 
-		C_buffer[offset].value = ' ';
+	for(size_t i = 0; i < C_workers; i++) {
+		pthread_t worker;
+		if(pthread_create(&worker, NULL, _worker, NULL))
+			K_panic(K_PTHREAD_ERR);
 	}
 
-	C_reset();
+	if(!K_headless) signal(SIGWINCH, on_resize);
+}
+
+/* Clearing the screen to draw the header leaves nothing of the last frame,
+ * so every cell is marked as needing to be sent again. */
+
+void C_draw_header() {
+	memset(C_shown, 0xff, sizeof(C_cell_t) * C_height * C_width);
+	if(K_headless) return;
 
 	if(C_width < strlen(C_LHEAD)) {
 		printf("\e[2J\e[H\e[7m%s", C_PROG_NAME);
@@ -211,282 +428,1255 @@ void C_initialise() {
 	fflush(stdout);
 }
 
+/* The frame is kept as separate flat arrays of characters, colours and
+ * depths. Colours are quantised to the 6x6x6 cube as they're drawn, so each
+ * cell is a byte of colour and a float of depth, and clearing the frame is a
+ * few straight loops the compiler can vectorise.
+ *
+ * The screen is split into bands of one row of tiles each. Lines and
+ * triangles arrive already projected, and are queued and binned into every
+ * band they cross. C_render() then has the bands cleared, rasterised and
+ * turned into escape codes in parallel, so C_reset() only needs to empty the
+ * queue. */
+
 void C_reset() {
-	for(size_t i = 0; i < C_height; i++)
-		for(size_t j = 0; j < C_width; j++)
-	{
-		size_t offset = i * C_width + j;
+	C_prim_count = 0;
+	for(size_t i = 0; i < C_tiles_y; i++) C_bands[i].count = 0;
+}
+
+void _bin(size_t prim, double top, double bottom) {
+	if(bottom < 0.0 || top >= C_height) return;
+	size_t first = fmax(top, 0.0) / C_TILE;
+	size_t last = fmin(bottom, C_height - 1.0) / C_TILE;
 
-		C_rvalue[offset] = C_gvalue[offset] = C_bvalue[offset] = 0.0;
-		C_zvalue[offset] = C_max_render;
-		C_cvalue[offset] = ' ';
+	for(size_t i = first; i <= last; i++) {
+		C_band_t *band = &C_bands[i];
+
+		if(band -> count == band -> max_prims) {
+			size_t max = band -> max_prims;
+			max = max ? max * 2 : 256;
+
+			size_t *prims = realloc(band -> prims,
+				sizeof(size_t) * max);
+
+			if(!prims) K_panic(K_MEM_ALLOC_ERR);
+			band -> prims = prims; band -> max_prims = max;
+		}
+
+		band -> prims[band -> count++] = prim;
 	}
 }
 
+size_t _add_prim(C_prim_t prim) {
+	if(C_prim_count == C_max_prims) {
+		C_max_prims = C_max_prims ? C_max_prims * 2 : 1024;
+		C_prims = realloc(C_prims, sizeof(C_prim_t) * C_max_prims);
+		if(!C_prims) K_panic(K_MEM_ALLOC_ERR);
+	}
+
+	C_prims[C_prim_count] = prim;
+	return C_prim_count++;
+}
+
+void C_add_line(vec_t start, vec_t end, vec_t colour) {
+	size_t prim = _add_prim((C_prim_t) {
+		{start, end, end}, colour, 0, true
+	});
+
+	_bin(prim, floor(fmin(start.z, end.z)), floor(fmax(start.z, end.z)));
+}
+
+void C_add_triangle(vec_t a, vec_t b, vec_t c, char ch, vec_t colour) {
+	if(fmax(a.x, fmax(b.x, c.x)) < 0.0) return;
+	if(fmin(a.x, fmin(b.x, c.x)) >= C_width) return;
+
+	size_t prim = _add_prim((C_prim_t) {{a, b, c}, colour, ch, false});
+	_bin(prim, floor(fmin(a.z, fmin(b.z, c.z))),
+		floor(fmax(a.z, fmax(b.z, c.z))));
+}
+
+/* Colours fade towards black with depth, reaching it at C_max_render. */
+
+int _level(double value) {
+	int level = value * 5.0 + 0.5;
+	return level < 0 ? 0 : level > 5 ? 5 : level;
+}
+
+unsigned char _shade(vec_t colour, double z) {
+	double fade = 1.0 - z / C_max_render;
+
+	return 36 * _level(colour.x * fade) + 6 * _level(colour.y * fade)
+		+ _level(colour.z * fade);
+}
+
 void _set_char(size_t x, size_t y, double z, char ch, vec_t colour) {
 	size_t offset = y * C_width + x;
 
-	if(z < C_zvalue[offset]) {
-		C_rvalue[offset] = colour.x / z;
-		C_gvalue[offset] = colour.y / z;
-		C_bvalue[offset] = colour.z / z;
+	if(z < C_depth[offset]) {
+		C_colour[offset] = _shade(colour, z);
+		C_cvalue[offset] = ch;
+		C_depth[offset] = z;
+	}
+}
+
+/* Points are in screen space, with x across, z down and y the depth. Lines
+ * take one Bresenham walk whichever way they go, stepping the inverse depth,
+ * which unlike the depth itself is linear across the screen. The character
+ * follows the slope, and cells off the screen or outside the band being
+ * drawn are skipped. */
+
+void _draw_line(C_prim_t *prim, long top, long bottom) {
+	vec_t start = prim -> points[0], end = prim -> points[1];
+	vec_t colour = prim -> colour;
+
+	long x = floor(start.x), y = floor(start.z);
+	long x2 = floor(end.x), y2 = floor(end.z);
+	long width = C_width;
+
+	long dx = labs(x2 - x), dy = -labs(y2 - y), err = dx + dy;
+	long sx = x < x2 ? 1 : -1, sy = y < y2 ? 1 : -1;
+	long steps = dx > -dy ? dx : -dy;
+
+	char ch = !steps ? '+' : dx > -dy ? '_' : dx < -dy ? '|'
+		: sx == sy ? '\\' : '/';
+
+	double iz = 1.0 / start.y;
+	double diz = steps ? (1.0 / end.y - iz) / steps : 0.0;
+
+	for(long i = 0; i <= steps; i++, iz += diz) {
+		if(x >= 0 && y >= top && x < width && y <= bottom)
+			_set_char(x, y, 1.0 / iz, ch, colour);
+
+		long e2 = 2 * err;
+		if(e2 >= dy) { err += dy; x += sx; }
+		if(e2 <= dx) { err += dx; y += sy; }
+	}
+}
+
+/* Triangles are filled by walking the tiles of C_TILE by C_TILE cells under
+ * their bounding box. The three edge functions, scaled so that they're the
+ * barycentric weights, are checked at the corners of each tile: a tile
+ * wholly outside one edge is skipped, and one wholly inside all three is
+ * filled without testing each cell. C_tile_depth keeps the furthest depth
+ * drawn in each tile, so a tile where the nearest point of the triangle is
+ * behind all of it is skipped before any cell is touched. Cells are sampled
+ * at their centres and tested against C_depth before they're shaded. */
 
+typedef struct { float x, y, c; } _plane_t;
+
+float _at(_plane_t p, float x, float y) { return p.x * x + p.y * y + p.c; }
+
+float _max_at(_plane_t p, float x0, float y0, float x1, float y1) {
+	return _at(p, p.x > 0.0f ? x1 : x0, p.y > 0.0f ? y1 : y0);
+}
+
+float _min_at(_plane_t p, float x0, float y0, float x1, float y1) {
+	return _at(p, p.x > 0.0f ? x0 : x1, p.y > 0.0f ? y0 : y1);
+}
+
+bool _fill_tile(_plane_t edges[3], _plane_t iz, size_t x0, size_t y0,
+	size_t x1, size_t y1, bool full, char ch, vec_t colour)
+{
+	bool drawn = false;
+
+	for(size_t y = y0; y <= y1; y++) for(size_t x = x0; x <= x1; x++) {
+		float cx = x + 0.5f, cy = y + 0.5f;
+
+		if(!full && (_at(edges[0], cx, cy) < 0.0f
+		|| _at(edges[1], cx, cy) < 0.0f
+		|| _at(edges[2], cx, cy) < 0.0f))
+			continue;
+
+		size_t offset = y * C_width + x;
+		float z = 1.0f / _at(iz, cx, cy);
+		if(z >= C_depth[offset]) continue;
+
+		C_colour[offset] = _shade(colour, z);
 		C_cvalue[offset] = ch;
-		C_zvalue[offset] = z;
-	}
-}
-
-void C_draw_line(vec_t start, vec_t end, vec_t colour) {
-	size_t width = (C_width - 2) >> 1, height = (C_height - 2) >> 1;
-
-	size_t x1 = start.x / start.y * width + width;
-	size_t y1 = start.z / start.y * height + height;
-
-	size_t x2 = end.x / end.y * width + width;
-	size_t y2 = end.z / end.y * height + height;
-
-	double z1 = start.y;
-	double z2 = end.y;
-
-	if(y1 >= C_height - 1 || y2 >= C_height - 1) return;
-	if(x1 >= C_width - 1 || x2 > C_width - 1) return;
-	if(x1 < 1 || x2 < 1 || y1 < 1 || y2 < 1) return;
-
-	intmax_t dx, dy, d;
-	double dz, z;
-	size_t x, y;
-	char ch;
-
-	if(x1 > x2) {
-		if(y1 > y2) {
-			dx = x1 - x2; dy = y1 - y2; dz = z1 - z2;
-			dz /= sqrt(dx * dx + dy * dy);
-
-			if(dx > dy) {
-				d = (2 * dy) - dx; y = y2; z = z2; ch = '_';
-				for(x = x2; x <= x1; ++x) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dx; ++y;
-						ch = '\\';
-					}
-
-					ch = '_'; d += 2 * dy; z += dz;
-				}
-			}
-
-			else if(dx < dy) {
-				d = (2 * dx) - dy; x = x1; z = z1; ch = '|';
-				for(y = y1; y >= y2; --y) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dy; --x; ch = '\\';
-					}
-					
-					ch = '|'; d += 2 * dx; z -= dz;
-				}
-			}
-
-			else {
-				y = y2; z = z2; ch = '\\';
-				for(x = x2; x <= x1; ++x) {
-					_set_char(x, y, z, ch, colour);
-					z += dz; ++y;
-				}
-			}
-		}
+		C_depth[offset] = z;
+		drawn = true;
+	}
 
-		else if(y1 < y2) {
-			dx = x1 - x2; dy = y2 - y1; dz = z2 - z1;
-			dz /= sqrt(dx * dx + dy * dy);
-
-			if(dx > dy) {
-				d = (2 * dy) - dx; y = y1; z = z1; ch = '_';
-				for(x = x1; x >= x2; --x) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dx; ++y; ch = '/';
-					}
-					
-					ch = '_'; d += 2 * dy; z += dz;
-				}
-			}
-
-			else if(dx < dy) {
-				d = (2 * dx) - dy; x = x1; z = z1; ch = '|';
-				for(y = y1; y <= y2; ++y) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dy; --x; ch = '/';
-					}
-					
-					ch = '|'; d += 2 * dx; z += dz;
-				}
-			}
-
-			else {
-				y = y2; z = z2; ch = '/';
-				for(x = x2; x <= x1; ++x) {
-					_set_char(x, y, z, ch, colour);
-					z -= dz; --y;
-				}
-			}
-		}
+	return drawn;
+}
+
+void _update_tile(size_t tx, size_t ty) {
+	size_t x1 = (tx + 1) * C_TILE, y1 = (ty + 1) * C_TILE;
+	if(x1 > C_width) x1 = C_width;
+	if(y1 > C_height) y1 = C_height;
+
+	float max = 0.0f;
+	for(size_t y = ty * C_TILE; y < y1; y++)
+		for(size_t x = tx * C_TILE; x < x1; x++)
+			if(C_depth[y * C_width + x] > max)
+				max = C_depth[y * C_width + x];
+
+	C_tile_depth[ty * C_tiles_x + tx] = max;
+}
+
+void _draw_triangle(C_prim_t *prim, double band_top, double band_bottom) {
+	vec_t a = prim -> points[0], b = prim -> points[1];
+	vec_t c = prim -> points[2], colour = prim -> colour;
+	char ch = prim -> ch;
+
+	double area = (b.x - a.x) * (c.z - a.z) - (b.z - a.z) * (c.x - a.x);
+	if(area == 0.0) return;
+	if(area < 0.0) { vec_t t = b; b = c; c = t; area = -area; }
+
+	vec_t p[3] = {a, b, c};
+	_plane_t edges[3], iz = {0.0f, 0.0f, 0.0f};
+	double near = fmin(a.y, fmin(b.y, c.y));
+
+	for(int i = 0; i < 3; i++) {
+		vec_t s = p[(i + 1) % 3], e = p[(i + 2) % 3];
+		double ex = (s.z - e.z) / area, ey = (e.x - s.x) / area;
+
+		edges[i] = (_plane_t) {ex, ey, -(ex * s.x + ey * s.z)};
+		iz.x += edges[i].x / p[i].y; iz.y += edges[i].y / p[i].y;
+		iz.c += edges[i].c / p[i].y;
+	}
+
+	double left = fmax(floor(fmin(a.x, fmin(b.x, c.x))), 0.0);
+	double top = fmax(floor(fmin(a.z, fmin(b.z, c.z))), band_top);
+	double right = fmin(floor(fmax(a.x, fmax(b.x, c.x))), C_width - 1.0);
+	double bottom = fmin(floor(fmax(a.z, fmax(b.z, c.z))), band_bottom);
+	if(left > right || top > bottom) return;
+
+	for(size_t ty = top / C_TILE; ty <= bottom / C_TILE; ty++)
+	for(size_t tx = left / C_TILE; tx <= right / C_TILE; tx++) {
+		size_t x0 = tx * C_TILE, y0 = ty * C_TILE;
+		size_t x1 = x0 + C_TILE - 1, y1 = y0 + C_TILE - 1;
+
+		if(x0 < left) x0 = left;
+		if(y0 < top) y0 = top;
+		if(x1 > right) x1 = right;
+		if(y1 > bottom) y1 = bottom;
+
+		float fx0 = x0 + 0.5f, fy0 = y0 + 0.5f;
+		float fx1 = x1 + 0.5f, fy1 = y1 + 0.5f;
+		bool full = true, outside = false;
+
+		for(int i = 0; i < 3; i++) {
+			if(_max_at(edges[i], fx0, fy0, fx1, fy1) < 0.0f)
+				outside = true;
 
-		else {
-			dz = (z1 - z2) / (x1 - x2); y = y2; z = z2; ch = '_';
-			for(x = x2; x <= x1; ++x) {
-				_set_char(x, y, z, ch, colour);
-				z += dz;
-			}
+			if(_min_at(edges[i], fx0, fy0, fx1, fy1) < 0.0f)
+				full = false;
 		}
+
+		if(outside) continue;
+
+		float z = 1.0f / _max_at(iz, fx0, fy0, fx1, fy1);
+		if(z < near) z = near;
+		if(z >= C_tile_depth[ty * C_tiles_x + tx]) continue;
+
+		if(_fill_tile(edges, iz, x0, y0, x1, y1, full, ch, colour))
+			_update_tile(tx, ty);
+	}
+}
+
+void C_write(const void *data, size_t len) {
+	if(!K_headless && !term_write(data, len)) K_panic(K_WRITE_SYS_ERR);
+}
+
+/* The colour codes of the 6x6x6 cube are formatted once into C_codes, so a
+ * cell only needs its index looked up. The foreground is the inverse of the
+ * background, which in the cube is just 215 minus its index.
+ *
+ * Only cells that differ from what's on screen are sent, as cursor-addressed
+ * runs with gaps shorter than a cursor move sent as-is, and the colour is only
+ * set when it differs from the cell before. Within a band, the cursor is moved
+ * relative to where the last run left it when that's shorter than addressing
+ * the cell outright. */
+
+#define C_MOVE_COST 8
+
+bool _same(size_t offset) {
+	return C_buffer[offset].colour == C_shown[offset].colour
+	    && C_buffer[offset].value == C_shown[offset].value;
+}
+
+size_t _put_cell(char *output, C_cell_t cell, int *colour) {
+	size_t len = 0;
+
+	if(cell.colour != *colour) {
+		memcpy(output, "\e[38;5;", 7);
+		memcpy(output + 7, C_codes[215 - cell.colour], 3);
+		memcpy(output + 10, "m\e[48;5;", 8);
+		memcpy(output + 18, C_codes[cell.colour], 3);
+
+		output[21] = 'm'; len = 22; *colour = cell.colour;
+	}
+
+	output[len++] = cell.value;
+	return len;
+}
+
+size_t _move(char *output, size_t row, size_t col, size_t i, size_t j) {
+	if(row == SIZE_MAX) return term_move(output, -1, 0, j, i + 1);
+	return term_move(output, col, row + 1, j, i + 1);
+}
+
+size_t _resolve(size_t top, size_t bottom, char *output) {
+	size_t len = 0, row = SIZE_MAX, col = 0; int colour = -1;
+
+	for(size_t k = top * C_width; k < bottom * C_width; k++) {
+		C_buffer[k].colour = C_colour[k];
+		C_buffer[k].value = C_cvalue[k];
+	}
+
+	for(size_t i = top; i < bottom; i++)
+		for(size_t j = 0; j < C_width; j++)
+	{
+		size_t k = i * C_width + j, end = k, stop = (i + 1) * C_width;
+		if(_same(k)) continue;
+
+		for(size_t l = k + 1; l < stop && l - end <= C_MOVE_COST; l++)
+			if(!_same(l)) end = l;
+
+		len += _move(output + len, row, col, i, j);
+
+		for(size_t l = k; l <= end; l++)
+			len += _put_cell(output + len, C_buffer[l], &colour);
+
+		j += end - k; row = i; col = j + 1;
+		if(col == C_width) row = SIZE_MAX;
 	}
 
-	else if(x1 < x2) {
-		if(y1 > y2) {
-			dx = x2 - x1; dy = y1 - y2; dz = z1 - z2;
-			dz /= sqrt(dx * dx + dy * dy);
-
-			if(dx > dy) {
-				d = (2 * dy) - dx; y = y2; z = z2; ch = '_';
-				for(x = x2; x >= x1; --x) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dx; ++y; ch = '/';
-					}
-					
-					ch = '_'; d += 2 * dy; z += dz;
-				}
-			}
-
-			else if(dx < dy) {
-				d = (2 * dx) - dy; x = x2; z = z2; ch = '|';
-				for(y = y2; y <= y1; ++y) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dy; --x; ch = '/';
-					}
-					
-					ch = '|'; d += 2 * dx; z += dz;
-				}
-			}
-
-			else {
-				y = y1; z = z1; ch = '/';
-				for(x = x1; x <= x2; ++x) {
-					_set_char(x, y, z, ch, colour);
-					z -= dz; --y;
-				}
-			}
+	memcpy(&C_shown[top * C_width], &C_buffer[top * C_width],
+		sizeof(C_cell_t) * (bottom - top) * C_width);
+
+	return len;
+}
+
+/* A resize can leave anything on screen, so the header and the last frame
+ * are sent again whole. The frame isn't drawn again, which would throw off the
+ * count of frames that a replay goes by. */
+
+void C_repaint() {
+	size_t len = 0; int colour = -1;
+	resized = 0; C_draw_header(); status_stale = true;
+	if(!frames) return;
+
+	for(size_t i = 0; i < C_height; i++) {
+		len += sprintf(C_output + len, "\e[%zu;1H", i + 2);
+
+		for(size_t j = 0; j < C_width; j++) len += _put_cell(
+			C_output + len, C_buffer[i * C_width + j], &colour);
+	}
+
+	memcpy(C_shown, C_buffer, sizeof(C_cell_t) * C_height * C_width);
+	C_write(C_output, len);
+}
+
+/* On a resize, the buffers are grown if they need to be, but never shrunk,
+ * and the last frame is cropped or padded to the new size so that there's
+ * something to repaint until the next one is drawn. The workers are only ever
+ * between frames here, but one may yet look for a band, so the count of bands
+ * is changed under C_lock with none left to take. With -o or -i, the screen
+ * stays the size it started at, so that the replay stays exact. */
+
+void *_grow(void *buffer, size_t size) {
+	if(!(buffer = realloc(buffer, size))) K_panic(K_MEM_ALLOC_ERR);
+	return buffer;
+}
+
+bool C_resize() {
+	int rows, cols; bool changed = false;
+	if(record_file || replay_file) goto repaint;
+
+	if(!term_size(&rows, &cols) || rows < 3 || cols < 1) goto repaint;
+	size_t width = cols, height = rows - 2;
+	if(width == C_width && height == C_height) goto repaint;
+
+	size_t cells = width * height, row_bytes = width * 23 + 16;
+	size_t tiles_x = (width + C_TILE - 1) / C_TILE;
+	size_t tiles_y = (height + C_TILE - 1) / C_TILE;
+
+	if(cells > C_max_cells) {
+		C_buffer = _grow(C_buffer, sizeof(C_cell_t) * cells);
+		C_shown = _grow(C_shown, sizeof(C_cell_t) * cells);
+		C_cvalue = _grow(C_cvalue, sizeof(char) * cells);
+		C_colour = _grow(C_colour, sizeof(char) * cells);
+		C_depth = _grow(C_depth, sizeof(float) * cells);
+		C_max_cells = cells;
+	}
+
+	if(height * row_bytes > C_max_output) {
+		C_max_output = height * row_bytes;
+		C_output = _grow(C_output, sizeof(char) * C_max_output);
+	}
+
+	if(tiles_x * tiles_y > C_max_tiles) {
+		C_max_tiles = tiles_x * tiles_y;
+		C_tile_depth = _grow(C_tile_depth, sizeof(float) * C_max_tiles);
+	}
+
+	for(size_t i = 0; i < height; i++) for(size_t j = 0; j < width; j++) {
+		C_cell_t blank = {0, ' '};
+		C_shown[i * width + j] = i < C_height && j < C_width
+			? C_buffer[i * C_width + j] : blank;
+	}
+
+	C_cell_t *buffer = C_buffer; C_buffer = C_shown; C_shown = buffer;
+	pthread_mutex_lock(&C_lock);
+
+	if(tiles_y > C_max_bands) {
+		C_bands = _grow(C_bands, sizeof(C_band_t) * tiles_y);
+		memset(&C_bands[C_max_bands], 0,
+			sizeof(C_band_t) * (tiles_y - C_max_bands));
+
+		C_max_bands = tiles_y;
+	}
+
+	C_width = width; C_height = height; C_row_bytes = row_bytes;
+	C_tiles_x = tiles_x; C_tiles_y = C_next_band = tiles_y;
+	pthread_mutex_unlock(&C_lock);
+	changed = true;
+
+repaint:
+	C_repaint();
+	return changed;
+}
+
+void _draw_band(size_t index) {
+	C_band_t *band = &C_bands[index];
+	size_t top = index * C_TILE, bottom = top + C_TILE;
+	if(bottom > C_height) bottom = C_height;
+
+	size_t start = top * C_width, size = (bottom - top) * C_width;
+	float depth = C_max_render;
+
+	memset(&C_cvalue[start], ' ', size);
+	memset(&C_colour[start], 0, size);
+	for(size_t i = start; i < start + size; i++) C_depth[i] = depth;
+
+	for(size_t i = 0; i < C_tiles_x; i++)
+		C_tile_depth[index * C_tiles_x + i] = depth;
+
+	for(size_t i = 0; i < band -> count; i++) {
+		C_prim_t *prim = &C_prims[band -> prims[i]];
+
+		if(prim -> line) _draw_line(prim, top, bottom - 1);
+		else _draw_triangle(prim, top, bottom - 1);
+	}
+
+	band -> len = _resolve(top, bottom, &C_output[top * C_row_bytes]);
+}
+
+/* Workers and the main thread take bands off a shared counter until there
+ * are none left. The last band to finish wakes the main thread, which then
+ * closes up the gaps between the bands' output and sends it in one go. */
+
+bool _take_band(size_t *index) {
+	pthread_mutex_lock(&C_lock);
+	bool taken = C_next_band < C_tiles_y;
+	if(taken) *index = C_next_band++;
+	pthread_mutex_unlock(&C_lock);
+	return taken;
+}
+
+void _run_bands() {
+	for(size_t index; _take_band(&index);) {
+		_draw_band(index);
+
+		pthread_mutex_lock(&C_lock);
+		if(++C_bands_done == C_tiles_y) pthread_cond_signal(&C_done);
+		pthread_mutex_unlock(&C_lock);
+	}
+}
+
+void *_worker(void *arg) {
+	size_t frame = 0; (void) arg;
+
+	while(true) {
+		pthread_mutex_lock(&C_lock);
+		while(C_frame == frame) pthread_cond_wait(&C_start, &C_lock);
+		frame = C_frame; pthread_mutex_unlock(&C_lock);
+
+		_run_bands();
+	}
+
+	return NULL;
+}
+
+void C_render() {
+	long long start = clock_ns();
+
+	pthread_mutex_lock(&C_lock);
+	C_next_band = C_bands_done = 0; C_frame++;
+	pthread_cond_broadcast(&C_start);
+	pthread_mutex_unlock(&C_lock);
+
+	_run_bands();
+
+	pthread_mutex_lock(&C_lock);
+	while(C_bands_done < C_tiles_y) pthread_cond_wait(&C_done, &C_lock);
+	pthread_mutex_unlock(&C_lock);
+
+	size_t len = 0;
+
+	for(size_t i = 0; i < C_tiles_y; i++) {
+		char *output = &C_output[i * C_TILE * C_row_bytes];
+		memmove(C_output + len, output, C_bands[i].len);
+		len += C_bands[i].len;
+	}
+
+	long long mid = clock_ns();
+	stats_add(&render_stats, mid - start);
+
+	C_write(C_output, len);
+	size_t bytes = len; S_update();
+
+	if(S_shown && status_stale) {
+		char line[sizeof(status) + 32];
+		int len = sprintf(line, "\e[1;1H\e[7m%-*.*s\e[0m",
+			(int) C_width, (int) C_width, status);
+
+		C_write(line, len);
+		bytes += len; status_stale = false;
+	}
+
+	stats_add(&output_stats, clock_ns() - mid);
+	stats_frame(bytes);
+}
+
+/* ======================== Graphics Pipeline Code ========================= */
+
+/* World space has x to the east, y to the north and z downwards; a camera
+ * with no yaw or pitch looks north. Vertices are queued up in world space and
+ * transformed together by G_flush(), which multiplies them all by one matrix
+ * that takes them to camera space with the screen scale folded in, so that
+ * only the divide by depth is left for each point. The loop runs over plain
+ * float arrays, which the compiler vectorises. */
+
+#define G_NEAR 0.1
+#define G_STEP 0.5
+#define G_TURN 5.0
+
+float G_matrix[3][4];
+
+bool G_key(int ch) {
+	double yaw = G_camera.yaw * M_PI / 180.0;
+	vec_t *position = &G_camera.position;
+
+	switch(ch) {
+	case 'w':
+		position -> x += G_STEP * sin(yaw);
+		position -> y += G_STEP * cos(yaw);
+		break;
+
+	case 's':
+		position -> x -= G_STEP * sin(yaw);
+		position -> y -= G_STEP * cos(yaw);
+		break;
+
+	case 'a':
+		position -> x -= G_STEP * cos(yaw);
+		position -> y += G_STEP * sin(yaw);
+		break;
+
+	case 'd':
+		position -> x += G_STEP * cos(yaw);
+		position -> y -= G_STEP * sin(yaw);
+		break;
+
+	case 'i': if(G_camera.pitch < 85.0) G_camera.pitch += G_TURN; break;
+	case 'k': if(G_camera.pitch > -85.0) G_camera.pitch -= G_TURN; break;
+	case 'j': G_camera.yaw = fmod(G_camera.yaw - G_TURN, 360.0); break;
+	case 'l': G_camera.yaw = fmod(G_camera.yaw + G_TURN, 360.0); break;
+
+	case 'r': if(G_camera.fov < 150.0) G_camera.fov += G_TURN; break;
+	case 'f': if(G_camera.fov > 30.0) G_camera.fov -= G_TURN; break;
+
+	default: return false;
+	}
+
+	return true;
+}
+
+vec_t G_forward() {
+	double yaw = G_camera.yaw * M_PI / 180.0;
+	double pitch = G_camera.pitch * M_PI / 180.0;
+
+	return (vec_t) {
+		sin(yaw) * cos(pitch), cos(yaw) * cos(pitch), -sin(pitch)
+	};
+}
+
+size_t G_add_vertex(vec_t vertex) {
+	if(G_vertices == G_max_vertices) {
+		float **arrays[] = {&G_wx, &G_wy, &G_wz, &G_cx, &G_cy, &G_cz};
+		G_max_vertices = G_max_vertices ? G_max_vertices * 2 : 1024;
+
+		for(int i = 0; i < 6; i++) {
+			size_t size = sizeof(float) * G_max_vertices;
+			*arrays[i] = realloc(*arrays[i], size);
+			if(!*arrays[i]) K_panic(K_MEM_ALLOC_ERR);
 		}
+	}
+
+	G_wx[G_vertices] = vertex.x;
+	G_wy[G_vertices] = vertex.y;
+	G_wz[G_vertices] = vertex.z;
+	return G_vertices++;
+}
+
+void G_add_line(size_t start, size_t end, vec_t colour) {
+	if(G_line_count == G_max_lines) {
+		G_max_lines = G_max_lines ? G_max_lines * 2 : 1024;
+		G_lines = realloc(G_lines, sizeof(G_line_t) * G_max_lines);
+		if(!G_lines) K_panic(K_MEM_ALLOC_ERR);
+	}
+
+	G_lines[G_line_count++] = (G_line_t) {start, end, colour};
+}
+
+void G_add_face(size_t vertices[4], char ch, vec_t colour) {
+	if(G_face_count == G_max_faces) {
+		G_max_faces = G_max_faces ? G_max_faces * 2 : 1024;
+		G_faces = realloc(G_faces, sizeof(G_face_t) * G_max_faces);
+		if(!G_faces) K_panic(K_MEM_ALLOC_ERR);
+	}
+
+	G_face_t *face = &G_faces[G_face_count++];
+	memcpy(face -> vertices, vertices, sizeof(face -> vertices));
+	face -> ch = ch; face -> colour = colour;
+}
+
+/* The rows of the view matrix are the camera's right, forward and down
+ * vectors. Terminal cells are about twice as tall as they're wide, so the
+ * vertical scale is half the horizontal one. */
+
+void _update_matrix() {
+	double yaw = G_camera.yaw * M_PI / 180.0;
+	double pitch = G_camera.pitch * M_PI / 180.0;
+	double scale = C_width / 2.0 / tan(G_camera.fov * M_PI / 360.0);
+
+	double rows[3][3] = {
+		{cos(yaw), -sin(yaw), 0.0},
+		{sin(yaw) * cos(pitch), cos(yaw) * cos(pitch), -sin(pitch)},
+		{sin(yaw) * sin(pitch), cos(yaw) * sin(pitch), cos(pitch)}
+	};
+
+	double scales[3] = {scale, 1.0, scale / 2.0};
+	vec_t p = G_camera.position;
+
+	for(int i = 0; i < 3; i++) {
+		for(int j = 0; j < 3; j++)
+			G_matrix[i][j] = rows[i][j] * scales[i];
+
+		G_matrix[i][3] = -(rows[i][0] * p.x + rows[i][1] * p.y
+			+ rows[i][2] * p.z) * scales[i];
+	}
+}
+
+void _transform(size_t count, float m[3][4],
+	const float *restrict wx, const float *restrict wy,
+	const float *restrict wz, float *restrict cx, float *restrict cy,
+	float *restrict cz)
+{
+	for(size_t i = 0; i < count; i++) {
+		float x = wx[i], y = wy[i], z = wz[i];
+
+		cx[i] = m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3];
+		cy[i] = m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3];
+		cz[i] = m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3];
+	}
+}
+
+vec_t _camera_point(size_t i) { return (vec_t) {G_cx[i], G_cy[i], G_cz[i]}; }
+
+vec_t _lerp(vec_t a, vec_t b, double t) {
+	return (vec_t) {
+		a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+		a.z + (b.z - a.z) * t
+	};
+}
+
+/* Lines are cut where they cross the near plane, projected, and then cut to
+ * the screen (Liang-Barsky), so the line drawer never walks far off its
+ * edges. Faces are cut to the near plane (Sutherland-Hodgman) and split into
+ * a fan of triangles; the rasteriser keeps to the screen by itself. */
+
+bool _clip_near(vec_t *a, vec_t *b) {
+	if(a -> y < G_NEAR && b -> y < G_NEAR) return false;
+
+	if(a -> y < G_NEAR)
+		*a = _lerp(*a, *b, (G_NEAR - a -> y) / (b -> y - a -> y));
+
+	else if(b -> y < G_NEAR)
+		*b = _lerp(*b, *a, (G_NEAR - b -> y) / (a -> y - b -> y));
+
+	return true;
+}
+
+vec_t _project(vec_t point) {
+	return (vec_t) {
+		point.x / point.y + C_width / 2.0, point.y,
+		point.z / point.y + C_height / 2.0
+	};
+}
+
+bool _clip_edge(double p, double q, double *t0, double *t1) {
+	if(p == 0.0) return q >= 0.0;
+	double t = q / p;
+
+	if(p < 0.0) { if(t > *t1) return false; if(t > *t0) *t0 = t; }
+	else { if(t < *t0) return false; if(t < *t1) *t1 = t; }
+	return true;
+}
+
+bool _clip_screen(vec_t *a, vec_t *b) {
+	double dx = b -> x - a -> x, dz = b -> z - a -> z, t0 = 0.0, t1 = 1.0;
+
+	if(!_clip_edge(-dx, a -> x, &t0, &t1)) return false;
+	if(!_clip_edge(dx, C_width - 1 - a -> x, &t0, &t1)) return false;
+	if(!_clip_edge(-dz, a -> z, &t0, &t1)) return false;
+	if(!_clip_edge(dz, C_height - 1 - a -> z, &t0, &t1)) return false;
+
+	vec_t start = _lerp(*a, *b, t0), end = _lerp(*a, *b, t1);
+	*a = start; *b = end; return true;
+}
+
+void _draw_face(G_face_t *face) {
+	vec_t in[4], out[8];
+	size_t count = 0;
+
+	for(int i = 0; i < 4; i++) in[i] = _camera_point(face -> vertices[i]);
+
+	for(int i = 0; i < 4; i++) {
+		vec_t a = in[i], b = in[(i + 1) % 4];
+
+		if(a.y >= G_NEAR) out[count++] = a;
+		if((a.y < G_NEAR) == (b.y < G_NEAR)) continue;
+
+		double t = (G_NEAR - a.y) / (b.y - a.y);
+		out[count++] = _lerp(a, b, t);
+	}
+
+	if(count < 3) return;
+	for(size_t i = 0; i < count; i++) out[i] = _project(out[i]);
+
+	for(size_t i = 2; i < count; i++) C_add_triangle(out[0], out[i - 1],
+		out[i], face -> ch, face -> colour);
+}
+
+void G_flush() {
+	_update_matrix();
+	_transform(G_vertices, G_matrix, G_wx, G_wy, G_wz, G_cx, G_cy, G_cz);
+
+	for(size_t i = 0; i < G_face_count; i++) _draw_face(&G_faces[i]);
+
+	for(size_t i = 0; i < G_line_count; i++) {
+		vec_t a = _camera_point(G_lines[i].start);
+		vec_t b = _camera_point(G_lines[i].end);
+
+		if(!_clip_near(&a, &b)) continue;
+		a = _project(a); b = _project(b);
+
+		if(!_clip_screen(&a, &b)) continue;
+		C_add_line(a, b, G_lines[i].colour);
+	}
+
+	G_vertices = G_line_count = G_face_count = 0;
+}
+
+/* ============================ Statistics Code ============================ */
+
+/* The frame statistics are term.h's; craft adds the frames it dropped to keep
+ * up, and counts only frames, which are its steps. */
+
+void S_update() {
+	if(!update_status(frames, "fps", 1e9 / K_frame)) return;
+
+	size_t len = strlen(status);
+	snprintf(status + len, sizeof(status) - len, ", %zu dropped",
+		S_dropped);
+}
+
+void S_toggle() {
+	S_shown = !S_shown; status_stale = true;
+	if(!S_shown) C_draw_header();
+}
+
+void S_dump() {
+	if(!stats_open("craft", NULL, frames, 1e9 / K_frame)) return;
+	fprintf(stats_file, "\t\"dropped_frames\": %zu,\n", S_dropped);
+	stats_close();
+}
+
+/* ========================= Chunk Management Code ========================= */
+
+/* The world is split into cubes of W_SIZE blocks a side, stored as flat
+ * arrays of block IDs in a pool sized to cover C_max_render around the camera
+ * and between the W_TOP and W_BOTTOM layers of chunks. Chunks are found
+ * through an open-addressed hash table from their coordinates to their index
+ * in the pool. When the camera crosses into another chunk, those now out of
+ * range are dropped, the table is rebuilt, and the gaps are generated anew,
+ * so memory never grows past the pool. */
+
+#define W_LAYERS (W_BOTTOM - W_TOP + 1)
+
+size_t _hash(int x, int y, int z) {
+	unsigned hash = x * 73856093u ^ y * 19349663u ^ z * 83492791u;
+	return hash & (W_table_size - 1);
+}
+
+void W_initialise() {
+	W_radius = (C_max_render + W_SIZE - 1) / W_SIZE + 1;
+	W_max_chunks = (2 * W_radius + 1) * (2 * W_radius + 1) * W_LAYERS;
+	W_table_size = 1;
+	while(W_table_size < 2 * W_max_chunks) W_table_size *= 2;
+
+	W_chunks = malloc(sizeof(W_chunk_t) * W_max_chunks);
+	W_table = malloc(sizeof(int) * W_table_size);
+	if(!W_chunks || !W_table) K_panic(K_MEM_ALLOC_ERR);
+
+	W_seed = rand();
+}
+
+W_chunk_t *W_find(int x, int y, int z) {
+	for(size_t i = _hash(x, y, z);; i = (i + 1) & (W_table_size - 1)) {
+		if(W_table[i] < 0) return NULL;
+
+		W_chunk_t *chunk = &W_chunks[W_table[i]];
+		if(chunk -> x == x && chunk -> y == y && chunk -> z == z)
+			return chunk;
+	}
+}
+
+int W_get_block(int x, int y, int z) {
+	W_chunk_t *chunk = W_find(x >> W_SHIFT, y >> W_SHIFT, z >> W_SHIFT);
+	if(!chunk) return W_AIR;
+
+	x &= W_SIZE - 1; y &= W_SIZE - 1; z &= W_SIZE - 1;
+	return chunk -> blocks[(z * W_SIZE + y) * W_SIZE + x];
+}
+
+void _mark_dirty(int x, int y, int z) {
+	W_chunk_t *chunk = W_find(x, y, z);
+	if(chunk) chunk -> dirty = true;
+}
+
+/* Changing a block on the edge of a chunk can expose or hide a face of the
+ * chunk next to it, so that one's mesh is rebuilt as well. */
 
-		else if(y1 < y2) {
-			dx = x2 - x1; dy = y2 - y1; dz = z2 - z1;
-			dz /= sqrt(dx * dx + dy * dy);
-
-			if(dx > dy) {
-				d = (2 * dy) - dx; y = y1; z = z1; ch = '_';
-				for(x = x1; x <= x2; ++x) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dx; ++y; ch = '\\';
-					}
-					
-					ch = '_'; d += 2 * dy; z += dz;
-				}
-			}
-
-			else if(dx < dy) {
-				d = (2 * dx) - dy; x = x2; z = z2; ch = '|';
-				for(y = y2; y >= y1; --y) {
-					_set_char(x, y, z, ch, colour);
-
-					if(d > 0) {
-						d -= 2 * dy; --x; ch = '\\';
-					}
-					
-					ch = '|'; d += 2 * dx; z -= dz;
-				}
-			}
-
-			else {
-				y = y1; z = z1; ch = '\\';
-				for(x = x1; x <= x2; ++x) {
-					_set_char(x, y, z, ch, colour);
-					z += dz; ++y;
-				}
-			}
+void W_set_block(int x, int y, int z, int block) {
+	int cx = x >> W_SHIFT, cy = y >> W_SHIFT, cz = z >> W_SHIFT;
+	W_chunk_t *chunk = W_find(cx, cy, cz);
+	if(!chunk) return;
+
+	x &= W_SIZE - 1; y &= W_SIZE - 1; z &= W_SIZE - 1;
+	chunk -> blocks[(z * W_SIZE + y) * W_SIZE + x] = block;
+	chunk -> dirty = true;
+
+	if(x == 0) _mark_dirty(cx - 1, cy, cz);
+	if(x == W_SIZE - 1) _mark_dirty(cx + 1, cy, cz);
+	if(y == 0) _mark_dirty(cx, cy - 1, cz);
+	if(y == W_SIZE - 1) _mark_dirty(cx, cy + 1, cz);
+	if(z == 0) _mark_dirty(cx, cy, cz - 1);
+	if(z == W_SIZE - 1) _mark_dirty(cx, cy, cz + 1);
+}
+
+/* The block under the crosshair is found by walking the ray from the camera
+ * one block boundary at a time (Amanatides and Woo), always crossing
+ * whichever of the three axes it reaches first, so the cost only grows with
+ * the distance covered. The chunk is only looked up again when the ray
+ * leaves it. The face is the one the ray came in through, numbered as in
+ * W_quad_t, or -1 if the camera is inside the block. */
+
+bool W_pick(vec_t origin, vec_t direction, double range, W_hit_t *hit) {
+	double o[3] = {origin.x, origin.y, origin.z};
+	double d[3] = {direction.x, direction.y, direction.z};
+	double next[3], delta[3];
+	int p[3], step[3], face = -1;
+
+	for(int i = 0; i < 3; i++) {
+		p[i] = floor(o[i]); step[i] = d[i] < 0.0 ? -1 : 1;
+		delta[i] = d[i] ? fabs(1.0 / d[i]) : 0.0;
+
+		if(d[i] < 0.0) next[i] = (o[i] - p[i]) * delta[i];
+		else if(d[i] > 0.0) next[i] = (p[i] + 1 - o[i]) * delta[i];
+		else next[i] = range + 1.0;
+	}
+
+	W_chunk_t *chunk = NULL;
+	int cx = 0, cy = 0, cz = 0;
+
+	while(true) {
+		int x = p[0] >> W_SHIFT, y = p[1] >> W_SHIFT;
+		int z = p[2] >> W_SHIFT, mask = W_SIZE - 1;
+
+		if(!chunk || x != cx || y != cy || z != cz) {
+			chunk = W_find(x, y, z);
+			cx = x; cy = y; cz = z;
 		}
 
-		else {
-			dz = (z2 - z1) / (x2 - x1); y = y1; z = z1; ch = '_';
-			for(x = x1; x <= x2; ++x) {
-				_set_char(x, y, z, ch, colour);
-				z += dz;
-			}
+		int block = chunk ? chunk -> blocks[((p[2] & mask) * W_SIZE
+			+ (p[1] & mask)) * W_SIZE + (p[0] & mask)] : W_AIR;
+
+		if(block != W_AIR) {
+			*hit = (W_hit_t) {p[0], p[1], p[2], face, block};
+			return true;
 		}
+
+		int axis = next[0] < next[1] ? 0 : 1;
+		if(next[2] < next[axis]) axis = 2;
+		if(next[axis] > range) return false;
+
+		p[axis] += step[axis]; next[axis] += delta[axis];
+		face = axis * 2 + (step[axis] < 0);
 	}
+}
 
-	else {
-		if(y1 > y2) {
-			dz = (z1 - z2) / (y1 - y2); x = x2; z = z2; ch = '|';
-			for(y = y2; y <= y1; ++y) {
-				_set_char(x, y, z, ch, colour);
-				z += dz;
-			}
-		}
+/* Q and E cycle through the kinds of block, U places one against the face
+ * under the crosshair, as long as that isn't where the camera is, and O
+ * digs out the block itself. */
+
+bool W_key(int ch) {
+	W_hit_t hit;
+	vec_t camera = G_camera.position;
+
+	switch(ch) {
+	case 'q':
+		W_selected = W_selected == W_GRASS ? W_STONE : W_selected - 1;
+		return true;
+
+	case 'e':
+		W_selected = W_selected == W_STONE ? W_GRASS : W_selected + 1;
+		return true;
+
+	case 'u':
+		if(!W_pick(camera, G_forward(), C_max_render, &hit)) break;
+		if(hit.face < 0) break;
+
+		int p[3] = {hit.x, hit.y, hit.z};
+		p[hit.face / 2] += hit.face % 2 ? 1 : -1;
+
+		if(p[0] == floor(camera.x) && p[1] == floor(camera.y)
+		&& p[2] == floor(camera.z))
+			break;
+
+		W_set_block(p[0], p[1], p[2], W_selected);
+		return true;
+
+	case 'o':
+		if(!W_pick(camera, G_forward(), C_max_render, &hit)) break;
+		W_set_block(hit.x, hit.y, hit.z, W_AIR);
+		return true;
+	}
+
+	return false;
+}
+
+/* Terrain is two octaves of value noise over a hash of the block coordinates
+ * and the seed, giving the height of the ground at each column. */
+
+double _noise(int x, int y) {
+	unsigned hash = x * 374761393u + y * 668265263u + W_seed * 2246822519u;
+	hash = (hash ^ (hash >> 13)) * 1274126177u;
+	return (hash ^ (hash >> 16)) / 4294967296.0;
+}
+
+double _smooth_noise(int x, int y, int scale) {
+	int x0 = x >= 0 ? x / scale : (x + 1) / scale - 1;
+	int y0 = y >= 0 ? y / scale : (y + 1) / scale - 1;
 
-		else if(y1 < y2) {
-			dz = (z2 - z1) / (y2 - y1); x = x1; z = z1; ch = '|';
-			for(y = y1; y <= y2; ++y) {
-				_set_char(x, y, z, ch, colour);
-				z += dz;
-			}
+	double fx = (x - x0 * scale) / (double) scale;
+	double fy = (y - y0 * scale) / (double) scale;
+
+	fx = fx * fx * (3 - 2 * fx); fy = fy * fy * (3 - 2 * fy);
+
+	double top = _noise(x0, y0) * (1 - fx) + _noise(x0 + 1, y0) * fx;
+	double bottom = _noise(x0, y0 + 1) * (1 - fx)
+		+ _noise(x0 + 1, y0 + 1) * fx;
+
+	return top * (1 - fy) + bottom * fy;
+}
+
+int _ground(int x, int y) {
+	double height = 0.7 * _smooth_noise(x, y, 16);
+	height += 0.3 * _smooth_noise(x + 1000, y + 1000, 5);
+	return height * 12.0 - 6.0;
+}
+
+void _generate(W_chunk_t *chunk, int x, int y, int z) {
+	chunk -> x = x; chunk -> y = y; chunk -> z = z;
+	chunk -> quads = NULL; chunk -> quad_count = chunk -> max_quads = 0;
+	chunk -> dirty = true;
+
+	for(int j = 0; j < W_SIZE; j++) for(int i = 0; i < W_SIZE; i++) {
+		int ground = _ground(x * W_SIZE + i, y * W_SIZE + j);
+
+		for(int k = 0; k < W_SIZE; k++) {
+			int depth = z * W_SIZE + k - ground;
+			unsigned char *block = &chunk -> blocks[
+				(k * W_SIZE + j) * W_SIZE + i];
+
+			if(depth < 0) *block = W_AIR;
+			else if(depth == 0) *block = W_GRASS;
+			else if(depth < 4) *block = W_DIRT;
+			else *block = W_STONE;
 		}
+	}
+}
+
+void _insert(int index) {
+	W_chunk_t *chunk = &W_chunks[index];
+	size_t i = _hash(chunk -> x, chunk -> y, chunk -> z);
+
+	while(W_table[i] >= 0) i = (i + 1) & (W_table_size - 1);
+	W_table[i] = index;
+}
+
+void W_update(vec_t position) {
+	int cx = (int) floor(position.x) >> W_SHIFT;
+	int cy = (int) floor(position.y) >> W_SHIFT;
+	if(W_chunk_count && cx == W_centre_x && cy == W_centre_y) return;
 
-		else {
-			x = x1; y = y1; z = z1; ch = '+';
-			_set_char(x, y, z, ch, colour);
+	W_centre_x = cx; W_centre_y = cy;
+	size_t count = 0;
+
+	for(size_t i = 0; i < W_chunk_count; i++) {
+		if(abs(W_chunks[i].x - cx) > W_radius
+		|| abs(W_chunks[i].y - cy) > W_radius)
+		{
+			free(W_chunks[i].quads);
+			continue;
 		}
+
+		W_chunks[count++] = W_chunks[i];
+	}
+
+	W_chunk_count = count;
+	for(size_t i = 0; i < W_table_size; i++) W_table[i] = -1;
+	for(size_t i = 0; i < W_chunk_count; i++) _insert(i);
+
+	for(int x = cx - W_radius; x <= cx + W_radius; x++)
+	for(int y = cy - W_radius; y <= cy + W_radius; y++)
+	for(int z = W_TOP; z <= W_BOTTOM; z++) {
+		if(W_find(x, y, z)) continue;
+
+		_generate(&W_chunks[W_chunk_count], x, y, z);
+		_insert(W_chunk_count++);
+
+		_mark_dirty(x - 1, y, z); _mark_dirty(x + 1, y, z);
+		_mark_dirty(x, y - 1, z); _mark_dirty(x, y + 1, z);
+		_mark_dirty(x, y, z - 1); _mark_dirty(x, y, z + 1);
 	}
 }
 
-void C_render() {
-	for(size_t i = 0; i < C_height; i++)
-		for(size_t j = 0; j < C_width; j++)
-	{
-		size_t offset = i * C_width + j;
+/* Each chunk keeps a mesh of quads that's only rebuilt when it's marked
+ * dirty. For each of the six directions, every slice of the chunk gets a
+ * mask of the blocks whose face that way is open to the air, and the mask is
+ * covered greedily with the largest rectangles of one kind of block it'll
+ * take: first as far along the row as possible, then as many rows down as
+ * match. Faces between two solid blocks are never drawn at all. */
+
+int _block_at(W_chunk_t *chunk, int p[3]) {
+	if(p[0] >= 0 && p[0] < W_SIZE && p[1] >= 0 && p[1] < W_SIZE
+	&& p[2] >= 0 && p[2] < W_SIZE)
+		return chunk -> blocks[(p[2] * W_SIZE + p[1]) * W_SIZE + p[0]];
+
+	return W_get_block(chunk -> x * W_SIZE + p[0],
+		chunk -> y * W_SIZE + p[1], chunk -> z * W_SIZE + p[2]);
+}
+
+void _add_quad(W_chunk_t *chunk, W_quad_t quad) {
+	if(chunk -> quad_count == chunk -> max_quads) {
+		size_t max = chunk -> max_quads ? chunk -> max_quads * 2 : 64;
+		W_quad_t *quads = realloc(chunk -> quads,
+			sizeof(W_quad_t) * max);
+
+		if(!quads) K_panic(K_MEM_ALLOC_ERR);
+		chunk -> quads = quads; chunk -> max_quads = max;
+	}
 
-		int rvalue = C_rvalue[offset] * 5.0 + 0.5;
-		int gvalue = C_gvalue[offset] * 5.0 + 0.5;
-		int bvalue = C_bvalue[offset] * 5.0 + 0.5;
-		int colour = 36 * rvalue + 6 * gvalue + 1 * bvalue + 16;
+	chunk -> quads[chunk -> quad_count++] = quad;
+}
+
+void _emit_quad(W_chunk_t *chunk, int d, int side, int slice, int rect[4],
+	int block)
+{
+	int u = (d + 1) % 3, v = (d + 2) % 3;
+	int base[3] = {chunk -> x, chunk -> y, chunk -> z};
+	int i0 = rect[0], i1 = rect[0] + rect[2];
+	int j0 = rect[1], j1 = rect[1] + rect[3];
+	int corners[4][2] = {{i0, j0}, {i1, j0}, {i1, j1}, {i0, j1}};
 
-		char buffer[16];
-		sprintf(buffer, "%03d", colour);
-		memcpy(C_buffer[offset].bg_value, buffer, 3);
+	W_quad_t quad = {.block = block, .face = d * 2 + (side > 0)};
 
-		rvalue = 5 - rvalue; gvalue = 5 - gvalue; bvalue = 5 - bvalue;
-		colour = 36 * rvalue + 6 * gvalue + 1 * bvalue + 16;
+	for(int i = 0; i < 4; i++) {
+		float p[3];
 
-		sprintf(buffer, "%03d", colour);
-		memcpy(C_buffer[offset].fg_value, buffer, 3);
+		p[d] = slice + (side > 0);
+		p[u] = corners[i][0]; p[v] = corners[i][1];
+		for(int j = 0; j < 3; j++) p[j] += base[j] * W_SIZE;
 
-		C_buffer[offset].value = C_cvalue[offset];
+		quad.x[i] = p[0]; quad.y[i] = p[1]; quad.z[i] = p[2];
 	}
 
-	ssize_t ret = write(STDOUT_FILENO, "\e[2;1H", 6);
-	if(ret == -1) K_panic(K_WRITE_SYS_ERR);
+	_add_quad(chunk, quad);
+}
+
+void _build_mask(W_chunk_t *chunk, int d, int side, int slice,
+	unsigned char *mask)
+{
+	int u = (d + 1) % 3, v = (d + 2) % 3;
 
-	ret = write(STDOUT_FILENO, (void *) C_buffer, C_height * C_width * 23);
-	if(ret == -1) K_panic(K_WRITE_SYS_ERR);
+	for(int j = 0; j < W_SIZE; j++) for(int i = 0; i < W_SIZE; i++) {
+		int p[3], q[3];
+
+		p[d] = slice; p[u] = i; p[v] = j;
+		memcpy(q, p, sizeof(q)); q[d] += side;
+
+		int block = _block_at(chunk, p);
+		bool open = block != W_AIR && _block_at(chunk, q) == W_AIR;
+		mask[j * W_SIZE + i] = open ? block : W_AIR;
+	}
 }
 
-/* ========================= Chunk Management Code ========================= */
\ No newline at end of file
+void _cover_mask(W_chunk_t *chunk, int d, int side, int slice,
+	unsigned char *mask)
+{
+	for(int j = 0; j < W_SIZE; j++) for(int i = 0; i < W_SIZE; i++) {
+		unsigned char *row = &mask[j * W_SIZE];
+		int block = row[i];
+		if(block == W_AIR) continue;
+
+		int w = 1, h = 1;
+		while(i + w < W_SIZE && row[i + w] == block) w++;
+
+		for(; j + h < W_SIZE; h++) for(int k = 0; k < w; k++)
+			if(row[h * W_SIZE + i + k] != block) goto done;
+
+	done:	for(int l = 0; l < h; l++)
+			memset(&row[l * W_SIZE + i], W_AIR, w);
+
+		_emit_quad(chunk, d, side, slice, (int[]) {i, j, w, h}, block);
+	}
+}
+
+void _build_mesh(W_chunk_t *chunk) {
+	unsigned char mask[W_SIZE * W_SIZE];
+	chunk -> quad_count = 0; chunk -> dirty = false;
+
+	for(int d = 0; d < 3; d++) for(int side = -1; side <= 1; side += 2)
+	for(int slice = 0; slice < W_SIZE; slice++) {
+		_build_mask(chunk, d, side, slice, mask);
+		_cover_mask(chunk, d, side, slice, mask);
+	}
+}
+
+/* Chunks and quads further than C_max_render from the camera are skipped,
+ * as are quads facing away from it. Each block has its own character, which
+ * shows through as a texture, and faces are lit by which way they point. */
+
+vec_t W_colours[] = {
+	[W_GRASS] = {0.3, 0.9, 0.3}, [W_DIRT] = {0.6, 0.4, 0.2},
+	[W_STONE] = {0.6, 0.6, 0.6}
+};
+
+const char W_chars[] = {[W_GRASS] = '"', [W_DIRT] = '.', [W_STONE] = '%'};
+const double W_light[6] = {0.7, 0.8, 0.6, 0.9, 1.0, 0.4};
+
+double _distance(vec_t p, double min[3], double max[3]) {
+	double point[3] = {p.x, p.y, p.z}, sum = 0.0;
+
+	for(int i = 0; i < 3; i++) {
+		double d = point[i] < min[i] ? min[i] - point[i]
+			: point[i] > max[i] ? point[i] - max[i] : 0.0;
+
+		sum += d * d;
+	}
+
+	return sum;
+}
+
+bool _facing(W_quad_t *quad, vec_t camera) {
+	double plane[3] = {quad -> x[0], quad -> y[0], quad -> z[0]};
+	double point[3] = {camera.x, camera.y, camera.z};
+
+	int d = quad -> face / 2;
+	return quad -> face % 2 ? point[d] > plane[d] : point[d] < plane[d];
+}
+
+void _draw_quad(W_quad_t *quad, vec_t camera, double range) {
+	if(!_facing(quad, camera)) return;
+
+	double min[3] = {
+		fmin(quad -> x[0], quad -> x[2]),
+		fmin(quad -> y[0], quad -> y[2]),
+		fmin(quad -> z[0], quad -> z[2])
+	};
+
+	double max[3] = {
+		fmax(quad -> x[0], quad -> x[2]),
+		fmax(quad -> y[0], quad -> y[2]),
+		fmax(quad -> z[0], quad -> z[2])
+	};
+
+	if(_distance(camera, min, max) > range) return;
+
+	size_t v[4];
+	for(int i = 0; i < 4; i++) v[i] = G_add_vertex((vec_t) {
+		quad -> x[i], quad -> y[i], quad -> z[i]
+	});
+
+	vec_t colour = W_colours[quad -> block];
+	double light = W_light[quad -> face];
+
+	colour.x *= light; colour.y *= light; colour.z *= light;
+	G_add_face(v, W_chars[quad -> block], colour);
+}
+
+/* The block under the crosshair is outlined, just outside its faces so that
+ * they don't hide the lines, in the colour of the kind of block that U would
+ * place. */
+
+#define W_OUTLINE 0.02
+
+void _outline(W_hit_t hit) {
+	size_t v[8];
+
+	for(int i = 0; i < 8; i++) v[i] = G_add_vertex((vec_t) {
+		hit.x + (i & 1 ? 1.0 + W_OUTLINE : -W_OUTLINE),
+		hit.y + (i & 2 ? 1.0 + W_OUTLINE : -W_OUTLINE),
+		hit.z + (i & 4 ? 1.0 + W_OUTLINE : -W_OUTLINE)
+	});
+
+	vec_t colour = W_colours[W_selected];
+	colour.x *= 1.5; colour.y *= 1.5; colour.z *= 1.5;
+
+	for(int i = 0; i < 8; i++) for(int j = 0; j < 3; j++)
+		if(!(i & 1 << j)) G_add_line(v[i], v[i | 1 << j], colour);
+}
+
+void W_draw() {
+	vec_t camera = G_camera.position;
+	double range = C_max_render * C_max_render;
+
+	for(size_t n = 0; n < W_chunk_count; n++) {
+		W_chunk_t *chunk = &W_chunks[n];
+
+		double min[3] = {
+			chunk -> x * W_SIZE,
+			chunk -> y * W_SIZE,
+			chunk -> z * W_SIZE
+		};
+
+		double max[3] = {
+			min[0] + W_SIZE, min[1] + W_SIZE, min[2] + W_SIZE
+		};
+
+		if(_distance(camera, min, max) > range) continue;
+		if(chunk -> dirty) _build_mesh(chunk);
+
+		for(size_t i = 0; i < chunk -> quad_count; i++)
+			_draw_quad(&chunk -> quads[i], camera, range);
+	}
+
+	W_hit_t hit;
+	if(W_pick(camera, G_forward(), C_max_render, &hit)) _outline(hit);
+}
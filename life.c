@@ -15,40 +15,56 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <termios.h>
 #include <unistd.h>
 
-struct termios cooked, raw;
-char *back_buf, *front_buf;
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+#include "term.h"
+
+char *back_buf, *front_buf, *shown_buf;
 int height, width;
 
-long delay = 125000000L;
-bool paused = false;
+pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t unpaused = PTHREAD_COND_INITIALIZER;
+size_t generation, shown_generation = -1;
+
+long delay = 125000000L, frame = 16666667L;
+bool paused = false, show_stats = false;
 int x, y;
 
 void swap_bufs() { char *b = back_buf; back_buf = front_buf; front_buf = b; }
-void refresh_scr() { puts("\e[1;1H"); puts(front_buf); }
-
-void putch(char ch) { printf("\e[%d;%dH\e[7m%c\e[0m", y + 2, x + 1, ch); }
 void put_spaces(int n) { for(int i = 0; i < n; i++) putchar(' '); }
 
-void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &cooked); }
-void pauseprg(long ns) { nanosleep((const struct timespec[]){{0, ns}}, NULL); }
-void exitprg(int ret) { reset_terminal(); printf("\e[?25h"); exit(ret); }
+void putch(char ch) { out_goto(x, y + 1); out_attr(7); out_put(&ch, 1); }
 
-#define FCNTL_SET_ERR "Error setting input to non-blocking with fcntl()."
-#define TCGETATTR_ERR "Error getting terminal properties with tcgetattr()."
-#define TCSETATTR_ERR "Error setting terminal properties with tcsetattr()."
-#define SCREEN_HW_ERR "Error getting screen size with ANSI escape codes."
 #define MEM_ALLOC_ERR "Error allocating memory with malloc()."
+#define PTHREAD_C_ERR "Error starting the simulation with pthread_create()."
+#define PTHREAD_W_ERR "Error starting checkpoints with pthread_create()."
+#define CKPT_LOAD_ERR "Error reading the checkpoint to resume from."
+#define CKPT_SAVE_ERR "Error writing the final checkpoint."
+#define REPLAY_ERR "Error reading the header of the file to replay."
+#define REPLAY_SIZE_ERR "Error replaying: the terminal isn't the recorded size."
+#define TIMER_ERR "Error creating a timer with timerfd_create()."
 #define NON_REACH_ERR "This error shouldn't trigger; main() shouldn't exit."
 
+#define OPTIONS "ts:c:C:l:o:i:H"
+#define USAGE_MSG "%s: usage: %s [-t] [-s FILE] [-c FILE] [-C SECS] " \
+	"[-l FILE] [-o FILE] [-i FILE [-H]].\n"
+#define FOPEN_MSG "%s: error: can't open file.\n"
+
 #define BANNER "Tiny Life - Use WASD to Move, Space to Pause, Return to Exit"
 #define DESC "RF to Alter Speed, IO for Cell State, X to Reset, C to Clear"
 #define NAME "Tiny Life"
@@ -62,7 +78,142 @@ char buf_get(int x, int y) {
 
 void back_buf_put(int x, int y, char ch) { back_buf[y * width + x] = ch; }
 void front_buf_put(int x, int y, char ch) { front_buf[y * width + x] = ch; }
-void game_over() { printf("\e[2J\e[H%s %s\n", NAME, CREDITS); exitprg(0); }
+
+void draw_banner() {
+	if((unsigned) width < strlen(BANNER)) {
+		printf("\e[2J\e[H\e[7m%s", NAME);
+		put_spaces(width - strlen(NAME));
+		puts("\e[0m\e[?25l");
+	}
+	
+	else if((unsigned) width < strlen(BANNER) + strlen(DESC) + 3) {
+		printf("\e[2J\e[H\e[7m%s", BANNER);
+		put_spaces(width - strlen(BANNER));
+		puts("\e[0m\e[?25l");
+	}
+
+	else {
+		printf("\e[2J\e[H\e[7m%s", BANNER);
+		put_spaces(width - strlen(BANNER) - strlen(DESC));
+		printf("%s\e[0m\e[?25l", DESC);
+	}
+
+	out_x = out_sgr = -1;
+}
+
+void put_status() {
+	out_goto(0, 0); out_attr(7);
+	out_len += sprintf(out_buf + out_len, "%-*.*s", width, width, status);
+	out_x = -1; status_stale = false;
+}
+
+char get_cell(size_t x, size_t y) { return front_buf[y * width + x]; }
+void put_cell(size_t x, size_t y, char ch) { front_buf_put(x, y, ch); }
+
+/* With -o, each key is logged along with how many generations have passed
+ * since the last one, after a line giving the seed and the size of the
+ * board. Generations are logged rather than times so that -i can apply the
+ * keys to exactly the same generations: the simulation waits at any that has
+ * a key due until the main thread has applied it. With -H as well, the replay
+ * runs with no terminal and no delay between generations. A key of zero marks
+ * where the run ended; when a replay runs out, the keyboard takes over again,
+ * or with -H, the run ends there. A run resumed with -l needs the same
+ * checkpoint to replay. */
+
+unsigned seed;
+
+void game_over() {
+	bool saved = ckpt_finish(generation, width, height);
+	record_key(generation, 0);
+
+	if(!headless) printf("\e[2J\e[H");
+	else printf("Replayed %zu generations in %.3f s.\n", generation,
+		(clock_ns() - start_ns) / 1e9);
+
+	printf("%s %s\n", NAME, CREDITS);
+
+	if(!saved) { puts(CKPT_SAVE_ERR); exitprg(12); }
+	dump_stats("life", "generations", generation, 1e9 / delay);
+	exitprg(0);
+}
+
+/* When the terminal is resized, the board is cropped or padded with dead
+ * cells to fit, keeping the top left corner where it was, as with a
+ * checkpoint from a differently sized terminal. The buffers are only ever
+ * grown, so shrinking and growing back again doesn't reallocate anything.
+ * Any checkpoint being written is waited for before its buffers move. With
+ * -o or -i, the board stays the size it started at, so that replays stay
+ * exact. */
+
+size_t board_cap, out_cap;
+
+void *grow(void *buf, size_t size) {
+	if(!(buf = realloc(buf, size))) { puts(MEM_ALLOC_ERR); exitprg(5); }
+	return buf;
+}
+
+void resize_board() {
+	int w, h;
+	if(!term_size(&h, &w)) return;
+
+	h -= 2;
+	if(w < 1 || h < 1 || (w == width && h == height)) return;
+	if(record_file || replay_file) return;
+
+	size_t cells = (size_t) w * h, out_size = cells + w + 64;
+
+	if(cells >= board_cap) {
+		board_cap = cells + 1;
+		front_buf = grow(front_buf, board_cap);
+		back_buf = grow(back_buf, board_cap);
+		shown_buf = grow(shown_buf, board_cap);
+	}
+
+	if(out_size > out_cap) out_buf = grow(out_buf, out_cap = out_size);
+
+	for(int j = 0; j < h; j++) for(int i = 0; i < w; i++)
+		back_buf[j * w + i] = i < width && j < height
+			? front_buf[j * width + i] : ' ';
+
+	swap_bufs(); out_cols = width = w; height = h; front_buf[cells] = 0;
+	if(x >= width) x = width - 1;
+	if(y >= height) y = height - 1;
+
+	if(ckpt_name && !ckpt_resize(cells)) {
+		puts(MEM_ALLOC_ERR); exitprg(5);
+	}
+}
+
+/* Changed cells are sent as cursor-addressed runs, with gaps shorter than a
+ * cursor move sent as-is. If that costs more than the whole board, the whole
+ * board is sent instead. The cell under the cursor is left marked as stale so
+ * that it's repainted without the highlight once the cursor moves off it. */
+
+#define MOVE_COST 10
+
+void refresh_scr() {
+	size_t full = height * width + 6;
+
+	for(int i = 0; i < height; i++) for(int j = 0; j < width; j++) {
+		int k = i * width + j, end = k, stop = (i + 1) * width;
+		if(front_buf[k] == shown_buf[k]) continue;
+
+		for(int l = k + 1; l < stop && l - end <= MOVE_COST; l++)
+			if(front_buf[l] != shown_buf[l]) end = l;
+
+		if(out_len + MOVE_COST + end - k + 1 > full) goto redraw;
+		out_goto(j, i + 1); out_attr(0);
+		out_put(front_buf + k, end - k + 1); j += end - k;
+	}
+
+	goto cursor;
+redraw:	out_len = 0; out_x = out_sgr = -1;
+	out_goto(0, 1); out_attr(0); out_put(front_buf, height * width);
+
+cursor:	memcpy(shown_buf, front_buf, height * width);
+	putch(buf_get(x, y)); shown_buf[y * width + x] = 0;
+	if(show_stats && status_stale) put_status();
+}
 
 int count_neighbours(int x, int y) {
 	return (buf_get(x - 1, y - 1) == '#') + (buf_get(x, y - 1) == '#')
@@ -87,8 +238,50 @@ void next_generation() {
 	swap_bufs();
 }
 
-void game_main() {
-	switch(getchar()) {
+/* The board is advanced on its own thread, a generation each time sim_fd
+ * fires, holding buf_lock only while it computes one. The timer is set going
+ * again whenever delay changes, or after a pause or a replayed key has held
+ * the board up, so that the next generation comes a whole delay later. The
+ * main thread takes the lock to apply key presses and to diff the latest
+ * generation against the screen, but writes the frame out after releasing it,
+ * so a slow terminal holds up the display without holding up the simulation. */
+
+int sim_fd; long sim_ns;
+
+void *simulate(void *arg) {
+	struct pollfd in = {sim_fd, POLLIN, 0};
+	uint64_t ticks;
+
+	while(true) {
+		pthread_mutex_lock(&buf_lock);
+		while(paused || replay_due(generation)) {
+			pthread_cond_wait(&unpaused, &buf_lock);
+			sim_ns = 0;
+		}
+
+		long long start = clock_ns();
+		next_generation(); generation++;
+		stats_add(&compute_stats, clock_ns() - start);
+		ckpt_start(generation, width, height);
+
+		if(sim_ns != delay) {
+			struct timespec t = {delay / 1000000000,
+				delay % 1000000000};
+
+			struct itimerspec it = {t, t}; sim_ns = delay;
+			timerfd_settime(sim_fd, 0, &it, NULL);
+		}
+
+		pthread_mutex_unlock(&buf_lock);
+		while(read(sim_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+			poll(&in, 1, -1);
+	}
+
+	return arg;
+}
+
+void game_key(int ch) {
+	switch(ch) {
 		case 'w': if(y > 0) { y--; } break;
 		case 'a': if(x > 0) { x--; } break;
 		case 's': if(y < height - 1) { y++; } break;
@@ -97,79 +290,231 @@ void game_main() {
 		case 'i': front_buf_put(x, y, '#'); break;
 		case 'o': front_buf_put(x, y, ' '); break;
 
-		case ' ': paused = paused ? false : true; goto wait;
+		case ' ': paused = paused ? false : true; break;
 		case 'r': delay -= delay / 10; break;
 		case 'f': delay += delay / 10; break;
-		case '\n': game_over(); break;
+		case '\n': case 0: game_over(); break;
+
+	case 't':
+		show_stats = show_stats ? false : true; status_stale = true;
+		if(show_stats) break;
+
+		if(!headless) draw_banner();
+		memset(shown_buf, 0, height * width);
+		break;
 
 	case 'c':
 		for(int i = 0; i < width * height; i++) front_buf[i] = ' ';
-		goto redisp;
+		break;
 
 	case 'x':
 		for(int i = 0; i < width * height; i++)
 			front_buf[i] = rand() % 2 ? ' ' : '#';
 
-	redisp:	if(paused) refresh_scr(); break;
-	wait:	if(paused) fcntl(STDIN_FILENO, F_SETFL, ~O_NONBLOCK);
-		else fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+		break;
 	}
 
-	if(!paused) { next_generation(); refresh_scr(); }
-	putch(buf_get(x, y)); fflush(stdout);
+	pthread_cond_signal(&unpaused);
 }
 
-int main() {
-	int ret = fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-	if(ret == -1) { puts(FCNTL_SET_ERR); exit(1); }
+void send_frame(long long start) {
+	if(!out_len) return;
+
+	long long mid = clock_ns();
+	stats_add(&render_stats, mid - start);
+
+	stats_frame(out_len);
+
+	if(!flush_out()) { puts(WRITE_SYS_ERR); exitprg(7); }
+	stats_add(&output_stats, clock_ns() - mid);
+}
+
+/* The main thread sleeps in poll() until a key arrives or the frame timer
+ * fires, so keys are seen as soon as they're pressed. While paused, only a key
+ * can wake it, so a paused board uses no CPU at all. */
+
+int frame_fd;
+
+void wait_event() {
+	struct pollfd in[] = {{STDIN_FILENO, POLLIN, 0}, {frame_fd, POLLIN, 0}};
+	uint64_t ticks;
+
+	if(replay_due(generation)) return;
+	poll(in, paused ? 1 : 2, -1);
+	while(read(frame_fd, &ticks, sizeof(ticks)) > 0);
+}
+
+void game_main() {
+	wait_event();
+
+	pthread_mutex_lock(&buf_lock);
+	bool changed = generation != shown_generation;
+
+	for(; replay_due(generation); replay_next()) {
+		record_key(generation, next_key);
+		game_key(next_key); changed = true;
+	}
+
+	for(int ch = getchar(); ch != EOF; ch = getchar()) {
+		if(next_key != EOF && ch != '\n') continue;
+		record_key(generation, ch); game_key(ch); changed = true;
+	}
+
+	if(resized) {
+		resize_board(); draw_banner();
+		memset(shown_buf, 0, height * width);
+		resized = 0; status_stale = changed = true;
+	}
+
+	long long start = clock_ns();
+	update_status(generation, "gen/s", 1e9 / delay);
+
+	if(changed) { refresh_scr(); shown_generation = generation; }
+	pthread_mutex_unlock(&buf_lock);
+	send_frame(start);
+}
+
+void replay_headless() {
+	while(true) {
+		for(; replay_due(generation); replay_next()) {
+			record_key(generation, next_key); game_key(next_key);
+		}
+
+		if(next_key == EOF || paused) game_over();
+
+		long long start = clock_ns();
+		next_generation(); generation++;
+		stats_add(&compute_stats, clock_ns() - start);
+		ckpt_start(generation, width, height);
+
+		start = clock_ns();
+		update_status(generation, "gen/s", 1e9 / delay);
+		refresh_scr(); send_frame(start);
+	}
+}
+
+int main(int argc, char **argv) {
+	seed = time(NULL);
+
+	for(int opt; (opt = getopt(argc, argv, OPTIONS)) != -1;) switch(opt) {
+		case 't': show_stats = true; break;
+		case 'c': ckpt_name = optarg; break;
+		case 'H': headless = true; break;
+
+	case 's':
+		stats_file = fopen(optarg, "w");
+		if(!stats_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
+
+	case 'C':
+		ckpt_period = atof(optarg) * 1e9;
+		if(ckpt_period > 0) break;
+
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
 
-	ret = tcgetattr(STDIN_FILENO, &cooked);
-	if(ret == -1) { puts(TCGETATTR_ERR); exit(2); }
+	case 'l':
+		load_file = fopen(optarg, "rb");
+		if(!load_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
 
-	raw = cooked;
-	raw.c_lflag &= ~(ICANON | ECHO);
+	case 'o':
+		record_file = fopen(optarg, "w");
+		if(!record_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
 
-	ret = tcsetattr(STDIN_FILENO, TCSANOW, &raw);
-	if(ret == -1) { puts(TCSETATTR_ERR); exit(3); }
+	case 'i':
+		replay_file = fopen(optarg, "r");
+		if(!replay_file) { printf(FOPEN_MSG, argv[0]); exit(10); }
+		break;
 
-	printf("\e[999;999H\e[6n");
-	while(getchar() != '\e');
+	default:
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
+	}
+
+	if(headless && !replay_file) {
+		printf(USAGE_MSG, argv[0], argv[0]); exit(9);
+	}
 
-	ret = scanf("[%d;%dR", &height, &width); height -= 2;
-	if(ret != 2) { puts(SCREEN_HW_ERR); exitprg(4); }
+	int size[2];
+	if(replay_file) {
+		int ret = fscanf(replay_file, "life %u %d %d", &seed, &size[0],
+			&size[1]);
+
+		if(ret != 3 || size[0] < 1 || size[1] < 1) {
+			puts(REPLAY_ERR); exit(13);
+		}
+	}
+
+	if(headless) { width = size[0]; height = size[1]; goto start; }
+
+	int ret = term_open(&height, &width); height -= 2;
+	if(ret) exit(ret);
+
+	if(replay_file && (width != size[0] || height != size[1])) {
+		puts(REPLAY_SIZE_ERR); exitprg(14);
+	}
 
-	front_buf = malloc(sizeof(char) * height * width + 1);
+start:	board_cap = height * width + 1;
+	front_buf = malloc(sizeof(char) * board_cap);
 	if(!front_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	back_buf = malloc(sizeof(char) * height * width + 1);
+	back_buf = malloc(sizeof(char) * board_cap);
 	if(!back_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
 
-	srand((unsigned) time(NULL));
+	shown_buf = calloc(board_cap, sizeof(char));
+	if(!shown_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	out_cols = width; out_cap = (height + 1) * width + 64;
+	out_buf = malloc(sizeof(char) * out_cap);
+	if(!out_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	srand(seed);
 
 	for(int i = 0; i < height * width; i++)
 		front_buf[i] = rand() % 2 ? ' ' : '#';
 
 	front_buf[height * width] = 0;
+	ckpt_magic = "tiny-life-1"; ckpt_cells = "#";
+	ckpt_get = get_cell; ckpt_put = put_cell;
 
-	if((unsigned) width < strlen(BANNER)) {
-		printf("\e[2J\e[H\e[7m%s", NAME);
-		put_spaces(width - strlen(NAME));
-		puts("\e[0m\e[?25l");
-	}
-	
-	else if((unsigned) width < strlen(BANNER) + strlen(DESC) + 3) {
-		printf("\e[2J\e[H\e[7m%s", BANNER);
-		put_spaces(width - strlen(BANNER));
-		puts("\e[0m\e[?25l");
+	if(load_file && !ckpt_load(&generation, width, height)) {
+		puts(CKPT_LOAD_ERR); exitprg(11);
 	}
 
-	else {
-		printf("\e[2J\e[H\e[7m%s", BANNER);
-		put_spaces(width - strlen(BANNER) - strlen(DESC));
-		printf("%s\e[0m\e[?25l", DESC);
+	last_step = next_step = generation;
+
+	if(replay_file) replay_next();
+	if(record_file) {
+		setvbuf(record_file, NULL, _IOLBF, 0);
+		fprintf(record_file, "life %u %d %d\n", seed, width, height);
 	}
 
-	refresh_scr();
-	while(true) { game_main(); if(!paused) pauseprg(delay); }
+	if(!ckpt_resize(height * width)) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+	if(!headless) { draw_banner(); signal(SIGWINCH, on_resize); }
+	start_ns = last_ns = ckpt_last = clock_ns();
+
+	/* Resizes go to the main thread, so that they cut its poll() short. */
+	sigset_t winch; sigemptyset(&winch); sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch, NULL);
+
+	pthread_t sim, writer;
+	ret = ckpt_name ? pthread_create(&writer, NULL, ckpt_writer, NULL) : 0;
+	if(ret) { puts(PTHREAD_W_ERR); exitprg(8); }
+	if(headless) replay_headless();
+
+	sim_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(sim_fd == -1) { puts(TIMER_ERR); exitprg(15); }
+
+	ret = pthread_create(&sim, NULL, simulate, NULL);
+	if(ret) { puts(PTHREAD_C_ERR); exitprg(8); }
+	pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+
+	frame_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(frame_fd == -1) { puts(TIMER_ERR); exitprg(15); }
+
+	struct timespec t = {0, frame};
+	timerfd_settime(frame_fd, 0, &(struct itimerspec) {t, t}, NULL);
+	while(true) game_main();
 	puts(NON_REACH_ERR); exitprg(6);
 }
\ No newline at end of file
@@ -14,7 +14,12 @@
  * You should have received a copy of the GNU General Public License along with
  * this program. If not, see <https://www.gnu.org/licenses/>. */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,154 +27,702 @@
 #include <termios.h>
 #include <unistd.h>
 
-struct termios cooked, raw;
-int height, width;
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 
-int randx() { return rand() % width; }
-int randy() { return rand() % height; }
+#include "term.h"
 
-void putch(int x, int y, char ch) { printf("\e[%d;%dH%c", y + 2, x + 1, ch); }
-void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &cooked); }
+int height, width;
 
-void pauseprg(long ns) { nanosleep((const struct timespec[]){{0, ns}}, NULL); }
-void exitprg(int ret) { reset_terminal(); printf("\e[?25h"); exit(ret); }
+void putch(int x, int y, char ch) { out_goto(x, y + 1); out_put(&ch, 1); }
 
-#define FCNTL_SET_ERR "Error setting input to non-blocking with fcntl()."
-#define TCGETATTR_ERR "Error getting terminal properties with tcgetattr()."
-#define TCSETATTR_ERR "Error setting terminal properties with tcsetattr()."
-#define SCREEN_HW_ERR "Error getting screen size with ANSI escape codes."
 #define MEM_ALLOC_ERR "Error allocating memory with malloc()."
 #define NON_REACH_ERR "This error shouldn't trigger; main() shouldn't exit."
+#define TIMER_ERR "Error creating the timer with timerfd_create()."
+#define PTHREAD_ERR "Error starting games with pthread_create()."
+#define REPLAY_ERR "Error reading the header of the file to replay."
+#define REPLAY_SIZE_ERR "Error replaying: the terminal isn't the recorded size."
 
 #define BANNER "Tiny Snake - Use WASD to Move"
 #define DESC "Space to Pause, Return to Exit, R to Speed Up, F to Slow Down."
 #define BY "Tiny Snake Copyright (C) 2021-2022 Jyothiraditya Nellakra"
 
-struct segment { struct segment *next; size_t x, y; } *head, *tail;
-char direction = 'd';
-char *map_memory;
+#define USAGE_MSG "%s: usage: %s [-t] [-s FILE] [-a] [-S SEED] [-o FILE] " \
+        "[-i FILE [-H]] [-n GAMES [-j THREADS] [-l LANES] [-b WxH]].\n"
+#define FOPEN_MSG "%s: error: can't open file.\n"
 
-long delay = 125000000L;
-int grace_moves = 3;
-int paused;
+/* A game is kept whole in a struct game, so that many can be played at once
+ * with no terminal, each with its own random state. The body is a ring buffer
+ * of cells big enough for the whole board, with head the newest segment and
+ * tail the oldest. Moving retires the tail and claims a new head; eating just
+ * claims the new head.
+ *
+ * The cells that food can go on are kept as a dense array, with each cell's
+ * place in it alongside, so a cell can be taken out or put back in constant
+ * time and food lands on one pick. Cells the tail has left hold a space and
+ * count as free. Every cell written is noted in changes, so the terminal only
+ * has to be sent those. */
 
-char map_get(int x, int y) { return map_memory[y * width + x]; }
-void map_put(int x, int y, char ch) { map_memory[y * width + x] = ch; }
-void put_two(int x, int y, char ch) { map_put(x, y, ch); putch(x, y, ch); }
+struct segment { int x, y; };
+struct change { int x, y; char ch; };
 
-int score = 0;
-int length = 2;
-int bonus = 0;
+struct game {
+        int width, height, capacity; unsigned seed;
+        struct segment *body; size_t head, tail;
 
-void game_over() { printf("\e[2J\e[H%s\nScore: %d\n", BY, score); exitprg(0); }
+        char *map; int *free_cells, *free_index, free_count, food;
+        char direction; int length, bonus, grace_moves; long score;
+        struct change changes[3]; int change_count;
+};
 
-void game_main() {
-        int x = head -> x, y = head -> y;
+enum { MOVED, BLOCKED, OVER };
 
-        switch(getchar()) {
-                case 'r': delay -= delay / 10; bonus++;  break;
-                case 'f': delay += delay / 10; bonus--; break;
-                case ' ': paused = paused ? 0 : 1; break;
-                case '\n': game_over(); break;
+size_t ring_next(struct game *g, size_t i) {
+        return i + 1 < (size_t) g -> height * g -> width ? i + 1 : 0;
+}
+
+int taken(char ch) { return ch == '#' || ch == '@'; }
+char map_get(struct game *g, int x, int y) {
+        return g -> map[y * g -> width + x];
+}
+
+void map_put(struct game *g, int x, int y, char ch) {
+        int i = y * g -> width + x;
+
+        if(taken(g -> map[i]) && !taken(ch)) {
+                g -> free_index[i] = g -> free_count;
+                g -> free_cells[g -> free_count++] = i;
+        }
+
+        else if(!taken(g -> map[i]) && taken(ch)) {
+                int last = g -> free_cells[--g -> free_count];
+                g -> free_cells[g -> free_index[i]] = last;
+                g -> free_index[last] = g -> free_index[i];
+        }
+
+        g -> map[i] = ch;
+        g -> changes[g -> change_count++] = (struct change) {x, y, ch};
+}
+
+void place_food(struct game *g) {
+        g -> food = -1;
+        if(!g -> free_count) return;
+
+        int i = g -> free_cells[rand_r(&g -> seed) % g -> free_count];
+        map_put(g, i % g -> width, i / g -> width, '@'); g -> food = i;
+}
+
+void game_free(struct game *g) {
+        free(g -> body); free(g -> map);
+        free(g -> free_cells); free(g -> free_index);
+}
+
+void game_reset(struct game *g, unsigned seed) {
+        int cells = g -> width * g -> height;
+
+        g -> seed = seed; g -> direction = 'd'; g -> length = 2;
+        g -> bonus = 0; g -> grace_moves = 3; g -> score = 0;
+        g -> change_count = 0;
+
+        memset(g -> map, 0, cells); g -> free_count = cells;
+        for(int i = 0; i < cells; i++)
+                g -> free_cells[i] = g -> free_index[i] = i;
+
+        g -> body[0] = (struct segment) {0, 0};
+        g -> body[1] = (struct segment) {1, 0};
+        g -> tail = 0; g -> head = 1;
+
+        map_put(g, 0, 0, '#'); map_put(g, 1, 0, '#'); place_food(g);
+}
+
+int game_init(struct game *g, int width, int height, unsigned seed) {
+        int cells = width * height;
+        *g = (struct game) {
+                .width = width, .height = height, .capacity = cells
+        };
+
+        g -> body = malloc(sizeof(struct segment) * cells);
+        g -> map = malloc(sizeof(char) * cells);
+        g -> free_cells = malloc(sizeof(int) * cells);
+        g -> free_index = malloc(sizeof(int) * cells);
+
+        if(!g -> body || !g -> map || !g -> free_cells || !g -> free_index) {
+                game_free(g); return 0;
+        }
+
+        game_reset(g, seed); return 1;
+}
+
+/* A game can be moved onto a board of a different size, as long as the snake
+ * fits on it; the food is put somewhere else if it doesn't. The board's memory
+ * is only reallocated to grow it. The body is rotated to the start of its ring
+ * buffer, as the ring is the size of the board, and the map is laid out again
+ * from the body, with the free cells counted up afresh. */
+
+void reverse(struct segment *s, size_t n) {
+        for(size_t i = 0; i < n / 2; i++) {
+                struct segment t = s[i];
+                s[i] = s[n - 1 - i]; s[n - 1 - i] = t;
+        }
+}
 
+int game_resize(struct game *g, int width, int height) {
+        size_t ring = (size_t) g -> width * g -> height, tail = g -> tail;
+        int cells = width * height, food = -1;
+
+        for(size_t i = tail;; i = ring_next(g, i)) {
+                struct segment c = g -> body[i];
+                if(c.x >= width || c.y >= height) return 0;
+                if(i == g -> head) break;
+        }
+
+        if(cells > g -> capacity) {
+                void *p = realloc(g -> body, sizeof(struct segment) * cells);
+                if(p) g -> body = p; else return 0;
+                if((p = realloc(g -> map, cells))) g -> map = p; else return 0;
+
+                p = realloc(g -> free_cells, sizeof(int) * cells);
+                if(p) g -> free_cells = p; else return 0;
+
+                p = realloc(g -> free_index, sizeof(int) * cells);
+                if(p) g -> free_index = p; else return 0;
+                g -> capacity = cells;
+        }
+
+        if(g -> food >= 0 && g -> food % g -> width < width
+                && g -> food / g -> width < height)
+                food = g -> food / g -> width * width + g -> food % g -> width;
+
+        reverse(g -> body, tail); reverse(g -> body + tail, ring - tail);
+        reverse(g -> body, ring);
+
+        g -> head = (g -> head + ring - tail) % ring; g -> tail = 0;
+        g -> width = width; g -> height = height; g -> change_count = 0;
+
+        memset(g -> map, 0, cells);
+        for(size_t i = 0; i <= g -> head; i++)
+                g -> map[g -> body[i].y * width + g -> body[i].x] = '#';
+
+        if(food >= 0) g -> map[food] = '@';
+        g -> food = food; g -> free_count = 0;
+
+        for(int i = 0; i < cells; i++) if(!taken(g -> map[i])) {
+                g -> free_index[i] = g -> free_count;
+                g -> free_cells[g -> free_count++] = i;
+        }
+
+        if(food < 0) place_food(g);
+        return 1;
+}
+
+void game_turn(struct game *g, int key) {
+        int x = g -> body[g -> head].x, y = g -> body[g -> head].y;
+
+        switch(key) {
         case 'w':
-                if(direction == 's' || y == 0) break;
-                if(map_get(x, y - 1) == '#') break;
-                direction = 'w'; break;
+                if(g -> direction == 's' || y == 0) break;
+                if(map_get(g, x, y - 1) == '#') break;
+                g -> direction = 'w'; break;
 
         case 'a':
-                if(direction == 'd' || x == 0) break;
-                if(map_get(x - 1, y) == '#') break;
-                direction = 'a'; break;
+                if(g -> direction == 'd' || x == 0) break;
+                if(map_get(g, x - 1, y) == '#') break;
+                g -> direction = 'a'; break;
 
         case 's':
-                if(direction == 'w' || y == height - 1) break;
-                if(map_get(x, y + 1) == '#') break;
-                direction = 's'; break;
+                if(g -> direction == 'w' || y == g -> height - 1) break;
+                if(map_get(g, x, y + 1) == '#') break;
+                g -> direction = 's'; break;
 
         case 'd':
-                if(direction == 'a' || x == width - 1) break;
-                if(map_get(x + 1, y) == '#') break;
-                direction = 'd';
+                if(g -> direction == 'a' || x == g -> width - 1) break;
+                if(map_get(g, x + 1, y) == '#') break;
+                g -> direction = 'd';
         }
+}
 
-        if(paused) return;
+int game_step(struct game *g) {
+        int x = g -> body[g -> head].x, y = g -> body[g -> head].y;
+        g -> change_count = 0;
 
-        switch(direction) {
+        switch(g -> direction) {
                 case 'w': if(y > 0) { y--; break; } else goto end;
                 case 'a': if(x > 0) { x--; break; } else goto end;
-                case 's': if(y < height - 1) { y++; break; } else goto end;
-                case 'd': if(x < width - 1) { x++; break; } else goto end;
+                case 's': if(y < g -> height - 1) { y++; break; } else goto end;
+                case 'd': if(x < g -> width - 1) { x++; break; } else goto end;
         }
 
-        switch(map_get(x, y)) {
+        switch(map_get(g, x, y)) {
         case '#': goto end;
 
         case '@':
-                head -> next = malloc(sizeof(struct segment));
-                if(!head -> next) { puts(MEM_ALLOC_ERR); exitprg(5); }
+                g -> head = ring_next(g, g -> head);
+                g -> body[g -> head] = (struct segment) {x, y};
 
-                head = head -> next; head -> x = x; head -> y = y;
-                put_two(x, y, '#');
+                map_put(g, x, y, '#'); place_food(g);
+                g -> length++; break;
 
-                while(map_get(x, y)) { x = randx(); y = randy(); }
-                put_two(x, y, '@');
+        default:
+                map_put(g, g -> body[g -> tail].x, g -> body[g -> tail].y, ' ');
+                g -> tail = ring_next(g, g -> tail);
 
-                length++; break;
+                g -> head = ring_next(g, g -> head);
+                g -> body[g -> head] = (struct segment) {x, y};
+                map_put(g, x, y, '#');
+        }
 
-        default:
-                head -> next = tail;
-                put_two(tail -> x, tail -> y, ' ');
+        g -> score += g -> length + g -> bonus + g -> grace_moves;
+        g -> grace_moves = 3; return MOVED;
+
+end:    if(!g -> grace_moves) return OVER;
+        g -> grace_moves--; return BLOCKED;
+}
+
+/* To step many games at once, such as for training an agent, a batch keeps
+ * them as a struct of arrays: game i's state is element i of each per-game
+ * array, and its body, board and free cells are the i'th block of cells in
+ * the per-cell ones. The head's position is kept alongside its place in the
+ * body, so a step needn't look it up. A game that's over stays that way until
+ * it's reset, which reuses its memory in place. */
+
+struct games {
+        int count, width, height;
+
+        unsigned *seed; int *head, *tail, *x, *y, *free_count, *food;
+        int *direction, *over, *ate, *length, *bonus, *grace_moves;
+        long *score; int *aim, *ahead, *trail, *entered, *left;
+
+        struct segment *body; char *map; int *free_cells, *free_index;
+};
+
+/* Fills in a struct game that points into game i's blocks, such as for the
+ * autopilot to choose its move from; it's only for looking at the game. */
+
+void games_view(struct games *b, int i, struct game *g) {
+        size_t base = (size_t) i * b -> width * b -> height;
+
+        g -> width = g -> capacity = b -> width; g -> height = b -> height;
+        g -> seed = b -> seed[i]; g -> body = &b -> body[base];
+        g -> head = b -> head[i]; g -> tail = b -> tail[i];
+
+        g -> map = &b -> map[base]; g -> free_cells = &b -> free_cells[base];
+        g -> free_index = &b -> free_index[base];
+        g -> free_count = b -> free_count[i]; g -> food = b -> food[i];
+
+        g -> direction = b -> direction[i]; g -> length = b -> length[i];
+        g -> bonus = b -> bonus[i]; g -> grace_moves = b -> grace_moves[i];
+        g -> score = b -> score[i]; g -> change_count = 0;
+}
+
+/* Takes a cell out of game i's free cells just as map_put() would, so that
+ * food lands where it would in a game played on its own. */
+
+void games_take(struct games *b, int i, int cell) {
+        size_t base = (size_t) i * b -> width * b -> height;
+        int *cells = &b -> free_cells[base], *index = &b -> free_index[base];
+
+        int last = cells[--b -> free_count[i]];
+        cells[index[cell]] = last; index[last] = index[cell];
+}
 
-                tail -> x = x; tail -> y = y;
-                put_two(x, y, '#');
+void games_place_food(struct games *b, int i) {
+        size_t base = (size_t) i * b -> width * b -> height;
+        b -> food[i] = -1;
+        if(!b -> free_count[i]) return;
 
-                tail = tail -> next; head = head -> next;
+        int n = rand_r(&b -> seed[i]) % b -> free_count[i];
+        int cell = b -> free_cells[base + n];
+
+        games_take(b, i, cell);
+        b -> map[base + cell] = '@'; b -> food[i] = cell;
+}
+
+void games_reset(struct games *b, int i, unsigned seed) {
+        int cells = b -> width * b -> height;
+        size_t base = (size_t) i * cells;
+
+        b -> seed[i] = seed; b -> direction[i] = 'd'; b -> over[i] = 0;
+        b -> length[i] = 2; b -> bonus[i] = 0; b -> grace_moves[i] = 3;
+        b -> score[i] = 0;
+
+        memset(&b -> map[base], 0, cells);
+        for(int j = 0; j < cells; j++)
+                b -> free_cells[base + j] = b -> free_index[base + j] = j;
+
+        b -> body[base] = (struct segment) {0, 0};
+        b -> body[base + 1] = (struct segment) {1, 0};
+        b -> tail[i] = 0; b -> head[i] = 1; b -> x[i] = 1; b -> y[i] = 0;
+
+        b -> map[base] = b -> map[base + 1] = '#'; b -> free_count[i] = cells;
+        games_take(b, i, 0); games_take(b, i, 1); games_place_food(b, i);
+}
+
+void games_free(struct games *b) {
+        free(b -> seed); free(b -> head); free(b -> tail); free(b -> x);
+        free(b -> y); free(b -> free_count); free(b -> food);
+        free(b -> direction); free(b -> over); free(b -> ate);
+        free(b -> length); free(b -> bonus); free(b -> grace_moves);
+        free(b -> score); free(b -> aim); free(b -> ahead);
+        free(b -> trail); free(b -> entered); free(b -> left);
+        free(b -> body); free(b -> map); free(b -> free_cells);
+        free(b -> free_index);
+}
+
+int games_init(struct games *b, int count, int width, int height,
+        unsigned seed)
+{
+        size_t n = count, cells = (size_t) width * height;
+        *b = (struct games) {
+                .count = count, .width = width, .height = height
+        };
+
+        b -> seed = malloc(sizeof(unsigned) * n);
+        b -> head = malloc(sizeof(int) * n);
+        b -> tail = malloc(sizeof(int) * n);
+        b -> x = malloc(sizeof(int) * n);
+        b -> y = malloc(sizeof(int) * n);
+        b -> free_count = malloc(sizeof(int) * n);
+        b -> food = malloc(sizeof(int) * n);
+        b -> direction = malloc(sizeof(int) * n);
+        b -> over = malloc(sizeof(int) * n);
+        b -> ate = malloc(sizeof(int) * n);
+        b -> length = malloc(sizeof(int) * n);
+        b -> bonus = malloc(sizeof(int) * n);
+        b -> grace_moves = malloc(sizeof(int) * n);
+        b -> score = malloc(sizeof(long) * n);
+        b -> aim = malloc(sizeof(int) * n);
+        b -> ahead = malloc(sizeof(int) * n);
+        b -> trail = malloc(sizeof(int) * n);
+        b -> entered = malloc(sizeof(int) * n);
+        b -> left = malloc(sizeof(int) * n);
+
+        b -> body = malloc(sizeof(struct segment) * n * cells);
+        b -> map = malloc(sizeof(char) * n * cells);
+        b -> free_cells = malloc(sizeof(int) * n * cells);
+        b -> free_index = malloc(sizeof(int) * n * cells);
+
+        if(!b -> seed || !b -> head || !b -> tail || !b -> x || !b -> y
+                || !b -> free_count || !b -> food || !b -> direction
+                || !b -> over || !b -> ate || !b -> length || !b -> bonus
+                || !b -> grace_moves || !b -> score || !b -> aim
+                || !b -> ahead || !b -> trail || !b -> entered
+                || !b -> left || !b -> body || !b -> map
+                || !b -> free_cells || !b -> free_index)
+        {
+                games_free(b); return 0;
+        }
+
+        for(int i = 0; i < count; i++) games_reset(b, i, seed + i);
+        return 1;
+}
+
+/* Picks a where mask is 1 and b where it's 0, with arithmetic rather than a
+ * branch, so that a loop of them can still be done several lanes at a time. */
+
+int pick(int mask, int a, int b) { return b + mask * (a - b); }
+
+/* Steps every game in a batch once, first turning each by its key in actions
+ * (or not at all for a zero), and puts how each step went in status. These
+ * are the rules of game_turn() and game_step(), worked out for every lane at
+ * once with the lane as the inner loop: each outcome is a mask, and every
+ * field is written in every lane, with its old value where the mask is clear.
+ * A cell off the board is read as cell 0, which the masks then ignore.
+ *
+ * Only the per-game arrays, all of ints, are touched in the middle pass, and
+ * as they never overlap, which the compiler can't see for itself, it can do
+ * several lanes at a time. Reads from the boards happen in a pass before it,
+ * which notes what lies where the key points, what lies straight ahead and
+ * which cell the tail is on. The middle pass notes which cell each game moved
+ * into and which its tail left, or -1, and the pass after it writes those to
+ * the boards. When the snake moves on
+ * without eating, the cell its tail left takes the new head's place in the
+ * free cells, as map_put() would leave them; eating turns food into body,
+ * which leaves them as they were. Only placing food, which has to draw from
+ * each game's own random state, is done a game at a time, and only for the
+ * games that ate. */
+
+void games_step(struct games *b, const int *actions, int *status) {
+        int count = b -> count, w = b -> width, h = b -> height, cells = w * h;
+
+        int *head = b -> head, *tail = b -> tail, *xs = b -> x, *ys = b -> y;
+        int *length = b -> length, *bonus = b -> bonus;
+        int *grace_moves = b -> grace_moves, *entered = b -> entered;
+        int *left = b -> left; long *score = b -> score;
+        int *direction = b -> direction, *over = b -> over, *ate = b -> ate;
+        int *aim = b -> aim, *ahead = b -> ahead, *trail = b -> trail;
+
+        struct segment *body = b -> body; char *map = b -> map;
+        int *free_cells = b -> free_cells, *free_index = b -> free_index;
+
+        for(int i = 0; i < count; i++) {
+                size_t base = (size_t) i * cells;
+                int key = actions[i], d = direction[i];
+
+                int x = xs[i] + (key == 'd') - (key == 'a');
+                int y = ys[i] + (key == 's') - (key == 'w');
+                int in = (x >= 0) & (x < w) & (y >= 0) & (y < h);
+                aim[i] = map[base + pick(in, y * w + x, 0)];
+
+                x = xs[i] + (d == 'd') - (d == 'a');
+                y = ys[i] + (d == 's') - (d == 'w');
+                in = (x >= 0) & (x < w) & (y >= 0) & (y < h);
+                ahead[i] = map[base + pick(in, y * w + x, 0)];
+
+                struct segment t = body[base + tail[i]];
+                trail[i] = t.y * w + t.x;
         }
 
-        score += length + bonus + grace_moves;
-        fflush(stdout);
+        #pragma GCC ivdep
+        for(int i = 0; i < count; i++) {
+                int key = actions[i], d = direction[i], grace = grace_moves[i];
+                int x0 = xs[i], y0 = ys[i], seen = aim[i], front = ahead[i];
+                int dead = over[i], live = !dead, grown = length[i];
+
+                int kx = (key == 'd') - (key == 'a');
+                int ky = (key == 's') - (key == 'w');
+                int dx = (d == 'd') - (d == 'a'), dy = (d == 's') - (d == 'w');
 
-        grace_moves = 3;
-        return;
+                int x = x0 + kx, y = y0 + ky;
+                int in = (x >= 0) & (x < w) & (y >= 0) & (y < h);
+
+                int turn = live & ((kx | ky) != 0) & in
+                        & ((kx + dx != 0) | (ky + dy != 0)) & (seen != '#');
+
+                direction[i] = pick(turn, key, d);
+                x = x0 + pick(turn, kx, dx); y = y0 + pick(turn, ky, dy);
+                in = (x >= 0) & (x < w) & (y >= 0) & (y < h);
+
+                int ch = pick(turn, seen, front), blocked = !in | (ch == '#');
+                int moved = live & !blocked, eat = moved & (ch == '@');
+                int slid = moved & !eat, done = live & blocked & !grace;
+
+                int step = pick(blocked, BLOCKED, MOVED);
+                status[i] = pick(dead | done, OVER, step);
+                over[i] = dead | done; ate[i] = eat; length[i] = grown + eat;
+
+                score[i] += moved * (grown + eat + bonus[i] + grace);
+                grace_moves[i] = pick(moved, 3, grace - (live & !done));
+
+                entered[i] = pick(moved, y * w + x, -1);
+                left[i] = pick(slid, trail[i], -1);
+
+                int next = head[i] + moved, after = tail[i] + slid;
+                head[i] = next - cells * (next == cells);
+                tail[i] = after - cells * (after == cells);
+
+                xs[i] = pick(moved, x, x0); ys[i] = pick(moved, y, y0);
+        }
 
-end:    if(!grace_moves) game_over();
-        else grace_moves--;
+        for(int i = 0; i < count; i++) {
+                size_t base = (size_t) i * cells;
+                int moved = entered[i] >= 0, slid = left[i] >= 0;
+                int cell = pick(moved, entered[i], 0);
+                int gone = pick(slid, left[i], 0);
+
+                struct segment *s = &body[base + head[i]];
+                s -> x = pick(moved, xs[i], s -> x);
+                s -> y = pick(moved, ys[i], s -> y);
+
+                int j = free_index[base + cell];
+                int *slot = &free_cells[base + j];
+                int *index = &free_index[base + gone];
+
+                *slot = pick(slid, gone, *slot); *index = pick(slid, j, *index);
+                map[base + gone] = pick(slid, ' ', map[base + gone]);
+                map[base + cell] = pick(moved, '#', map[base + cell]);
+        }
+
+        for(int i = 0; i < count; i++) if(ate[i]) games_place_food(b, i);
 }
 
-int main() {
-        int ret = fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-        if(ret == -1) { puts(FCNTL_SET_ERR); exit(1); }
+/* The autopilot follows a Hamiltonian cycle of the board, which can't go
+ * wrong: the body always lies along the cycle behind the head. While the
+ * snake is under half the board, it cuts across to whichever neighbouring
+ * cell is furthest along the cycle without passing the food or coming within
+ * PILOT_MARGIN cells of the tail. The cycle runs along one edge and then
+ * zigzags back, which needs an even number of rows or columns; when both are
+ * odd, it falls back on a breadth-first search for the food. */
 
-        ret = tcgetattr(STDIN_FILENO, &cooked);
-        if(ret == -1) { puts(TCGETATTR_ERR); exit(2); }
+#define PILOT_MARGIN 4
 
-        raw = cooked;
-        raw.c_lflag &= ~(ICANON | ECHO);
+struct pilot { int *order, *queue, *from; };
 
-        ret = tcsetattr(STDIN_FILENO, TCSANOW, &raw);
-        if(ret == -1) { puts(TCSETATTR_ERR); exit(3); }
+const struct { int key, dx, dy; } moves[4] = {
+        {'w', 0, -1}, {'a', -1, 0}, {'s', 0, 1}, {'d', 1, 0}
+};
 
-        printf("\e[999;999H\e[6n");
-        while(getchar() != '\e');
+void make_cycle(int *order, int rows, int cols, int row_step, int col_step) {
+        int n = 0;
+        for(int c = 0; c < cols; c++) order[c * col_step] = n++;
 
-        ret = scanf("[%d;%dR", &height, &width); height--;
-        if(ret != 2) { puts(SCREEN_HW_ERR); exitprg(4); }
+        for(int r = 1; r < rows; r++) for(int i = 1; i < cols; i++) {
+                int c = r % 2 ? cols - i : i;
+                order[r * row_step + c * col_step] = n++;
+        }
+
+        for(int r = rows - 1; r > 0; r--) order[r * row_step] = n++;
+}
+
+void pilot_free(struct pilot *p) {
+        free(p -> order); free(p -> queue); free(p -> from);
+}
+
+int pilot_init(struct pilot *p, int width, int height) {
+        int cells = width * height;
+
+        p -> order = malloc(sizeof(int) * cells);
+        p -> queue = malloc(sizeof(int) * cells);
+        p -> from = malloc(sizeof(int) * cells);
+        if(!p -> order || !p -> queue || !p -> from) {
+                pilot_free(p); return 0;
+        }
+
+        if(height % 2 == 0) make_cycle(p -> order, height, width, width, 1);
+        else if(width % 2 == 0) make_cycle(p -> order, width, height, 1, width);
+        else { free(p -> order); p -> order = NULL; }
+
+        return 1;
+}
+
+int neighbour(struct game *g, int cell, int i) {
+        int x = cell % g -> width + moves[i].dx;
+        int y = cell / g -> width + moves[i].dy;
+
+        if(x < 0 || y < 0 || x >= g -> width || y >= g -> height) return -1;
+        return y * g -> width + x;
+}
 
-        head = malloc(sizeof(struct segment));
-        if(!head) { puts(MEM_ALLOC_ERR); exitprg(5); }
+int pilot_search(struct pilot *p, struct game *g, int start) {
+        int cells = g -> width * g -> height, first = 0, last = 0;
+        for(int i = 0; i < cells; i++) p -> from[i] = -1;
 
-        head -> x = 1; head -> y = 0;
+        p -> queue[last++] = start; p -> from[start] = start;
 
-        tail = malloc(sizeof(struct segment));
-        if(!tail) { puts(MEM_ALLOC_ERR); exitprg(5); }
+        while(first < last) {
+                int cell = p -> queue[first++];
 
-        tail -> next = head; tail -> x = 0; tail -> y = 0;
+                if(cell == g -> food) {
+                        while(p -> from[cell] != start) cell = p -> from[cell];
+                        return cell;
+                }
 
-        map_memory = calloc(height * width, sizeof(char));
-        if(!map_memory) { puts(MEM_ALLOC_ERR); exitprg(5); }
+                for(int i = 0; i < 4; i++) {
+                        int next = neighbour(g, cell, i);
+                        if(next < 0 || p -> from[next] >= 0) continue;
+                        if(g -> map[next] == '#') continue;
 
-        printf("\e[2J\e[H\e[7m%s", BANNER);
+                        p -> from[next] = cell; p -> queue[last++] = next;
+                }
+        }
+
+        return -1;
+}
+
+int pilot_move(struct pilot *p, struct game *g) {
+        int cells = g -> width * g -> height;
+        struct segment h = g -> body[g -> head], t = g -> body[g -> tail];
+        int head = h.y * g -> width + h.x, tail = t.y * g -> width + t.x;
+        int target = -1;
+
+        if(p -> order) {
+                int base = p -> order[head], best = 0;
+                int to_tail = (p -> order[tail] - base + cells) % cells;
+                int to_food = g -> food < 0 ? cells
+                        : (p -> order[g -> food] - base + cells) % cells;
+
+                for(int i = 0; i < 4; i++) {
+                        int next = neighbour(g, head, i);
+                        if(next < 0 || g -> map[next] == '#') continue;
+
+                        int d = (p -> order[next] - base + cells) % cells;
+                        int shortcut = g -> length < cells / 2
+                                && d < to_tail - PILOT_MARGIN && d <= to_food;
+
+                        if((d == 1 || shortcut) && d > best) {
+                                best = d; target = next;
+                        }
+                }
+        }
+
+        else target = pilot_search(p, g, head);
+
+        for(int i = 0; i < 4 && target < 0; i++) {
+                int next = neighbour(g, head, i);
+                if(next >= 0 && g -> map[next] != '#') target = next;
+        }
+
+        for(int i = 0; i < 4; i++)
+                if(target >= 0 && neighbour(g, head, i) == target)
+                        return moves[i].key;
+
+        return g -> direction;
+}
+
+struct game game;
+struct pilot pilot;
+unsigned seed;
+
+long delay = 125000000L;
+int autopilot, paused, show_stats; long long render_ns;
+
+/* With -o, each key the game reads is logged along with how many ticks have
+ * passed since the last one, after a line giving the seed, the size of the
+ * board and whether the autopilot is on. Ticks are logged rather than times
+ * so that -i can feed the keys back on exactly the same ticks and replay the
+ * run; with -H as well, it does so with no terminal and no delay between
+ * ticks. Only ticks on which the game moves are counted, so keys pressed
+ * while it's paused, or wakes from a resize, don't change how the moves line
+ * up. A key of zero marks where the run ended. When a replay runs out, the
+ * keyboard takes over again, or with -H, the game ends there. */
+
+size_t steps;
+
+int get_key() {
+        unsigned char ch;
+        return read(STDIN_FILENO, &ch, 1) == 1 ? ch : EOF;
+}
+
+int read_key() {
+        int ch = EOF;
+
+        if(next_key == EOF) ch = headless ? 0 : get_key();
+        else if(!headless && get_key() == '\n') ch = '\n';
+        else if(replay_due(steps)) { ch = next_key; replay_next(); }
+
+        if(ch != EOF) record_key(steps, ch);
+        return ch;
+}
+
+/* Moves are ticked off by a timerfd, which is set going again whenever the
+ * delay changes or the game is unpaused. A paused game sleeps in poll() until
+ * a key arrives rather than spinning, unless there are replayed keys to get
+ * through. Keys are read with read() rather than stdio, so that none are left
+ * buffered where poll() can't see them. While the game runs, keys are still
+ * taken one a move, so that turns made in quick succession still queue up. */
+
+int timer_fd; long timer_ns;
+
+void wait_tick() {
+        struct pollfd in[] = {{STDIN_FILENO, POLLIN, 0}, {timer_fd, POLLIN, 0}};
+        uint64_t ticks;
+
+        if(paused) {
+                if(next_key == EOF) poll(in, 1, -1);
+                timer_ns = 0; return;
+        }
+
+        if(timer_ns != delay) {
+                struct timespec t = {delay / 1000000000, delay % 1000000000};
+                timerfd_settime(timer_fd, 0, &(struct itimerspec) {t, t}, NULL);
+                timer_ns = delay;
+        }
+
+        while(read(timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+                poll(in + 1, 1, -1);
+}
+
+void draw_banner() {
+        printf("\e[H\e[7m%s", BANNER);
 
         if((unsigned) width < strlen(BANNER) + strlen(DESC) + 3) {
                 int whitespace = width - strlen(BANNER);
@@ -183,14 +736,404 @@ int main() {
                 printf("%s\e[0m\e[?25l", DESC);
         }
 
-        put_two(0, 0, '#'); put_two(1, 0, '#');
-        srand((unsigned) time(NULL));
+        out_x = -1;
+}
+
+void send_out() {
+        if(out_len) stats_frame(out_len);
+        if(!flush_out()) { puts(WRITE_SYS_ERR); exitprg(12); }
+}
+
+void draw_board() {
+        printf("\e[2J"); draw_banner();
+
+        for(int y = 0; y < height; y++) {
+                out_goto(0, y + 1);
+
+                for(int x = 0; x < width; x++) {
+                        char ch = map_get(&game, x, y);
+                        out_buf[out_len++] = ch ? ch : ' ';
+                }
+
+                out_x = -1;
+        }
+}
+
+/* When the terminal is resized, the game is moved onto a board of the new
+ * size, and the autopilot plans its route around the new board. If the snake
+ * wouldn't fit, the board stays the size it was until the next resize. With
+ * -o or -i, the board stays the size it started at, so that replays stay
+ * exact. */
+
+size_t out_cap;
 
-        int x = 0, y = 0;
-        while(map_get(x, y)) { x = randx(); y = randy(); }
-        map_put(x, y, '@'); putch(x, y, '@');
+void resize_board() {
+        int w, h;
+        if(!term_size(&h, &w)) return;
+
+        h--;
+        if(w < 2 || h < 1 || (w == width && h == height)) return;
+        if(record_file || replay_file || !game_resize(&game, w, h)) return;
+
+        out_cols = width = w; height = h;
+        if(autopilot) {
+                pilot_free(&pilot);
+                if(!pilot_init(&pilot, width, height)) {
+                        puts(MEM_ALLOC_ERR); exitprg(5);
+                }
+        }
+
+        size_t size = (size_t) (height + 1) * (width + 16) + 64;
+        if(size <= out_cap) return;
+
+        free(out_buf); out_buf = malloc(sizeof(char) * (out_cap = size));
+        if(!out_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+}
+
+void draw_changes() {
+        long long start = clock_ns();
+
+        for(int i = 0; i < game.change_count; i++) {
+                struct change *c = &game.changes[i];
+                putch(c -> x, c -> y, c -> ch);
+        }
+
+        render_ns += clock_ns() - start;
+}
+
+void game_over() {
+        record_key(steps, 0);
+
+        if(!headless) printf("\e[2J\e[H");
+        else printf("Replayed %zu ticks in %.3f s.\n", steps,
+                (clock_ns() - start_ns) / 1e9);
+
+        printf("%s\nScore: %ld\n", BY, game.score);
+        dump_stats("snake", "ticks", steps, 1e9 / delay); exitprg(0);
+}
+
+void game_main() {
+        long long start = clock_ns();
+        render_ns = 0;
+
+        switch(read_key()) {
+                case 0: game_over(); break;
+                case 'r': delay -= delay / 10; game.bonus++;  break;
+                case 'f': delay += delay / 10; game.bonus--; break;
+                case ' ': paused = paused ? 0 : 1; break;
+                case '\n': game_over(); break;
+
+        case 't':
+                show_stats = show_stats ? 0 : 1; status_stale = true;
+                if(!show_stats && !headless) draw_banner();
+                break;
+
+        case 'w': if(!autopilot) game_turn(&game, 'w'); break;
+        case 'a': if(!autopilot) game_turn(&game, 'a'); break;
+        case 's': if(!autopilot) game_turn(&game, 's'); break;
+        case 'd': if(!autopilot) game_turn(&game, 'd'); break;
+        }
+
+        if(resized) {
+                resized = 0; status_stale = true;
+                resize_board(); draw_board(); send_out();
+        }
+
+        if(!paused) {
+                steps++;
+                if(autopilot) game_turn(&game, pilot_move(&pilot, &game));
+
+                switch(game_step(&game)) {
+                        case MOVED: draw_changes(); break;
+                        case OVER: game_over();
+                }
+        }
+
+        update_status(steps, "ticks/s", 1e9 / delay);
+
+        if(show_stats && status_stale) {
+                long long begin = clock_ns(); out_goto(0, 0);
+                out_len += sprintf(out_buf + out_len, "\e[7m%-*.*s\e[0m",
+                        width, width, status);
+
+                out_x = -1; status_stale = false;
+                render_ns += clock_ns() - begin;
+        }
+
+        long long mid = clock_ns();
+        stats_add(&compute_stats, mid - start - render_ns);
+        stats_add(&render_stats, render_ns);
+
+        send_out(); stats_add(&output_stats, clock_ns() - mid);
+}
+
+/* With -n, games are played by the autopilot with no terminal, as fast as
+ * they'll go. Each thread takes every so many games, seeded from the base
+ * seed and the game's number so that runs can be repeated, and a game ends
+ * when the snake dies, fills the board, or goes as long as the board has
+ * cells twice over without eating. */
+
+struct batch { int first; long long ticks; long score, length; int won; };
+
+int games, threads, lanes, board_width = 20, board_height = 20;
+
+void *play(void *arg) {
+        struct batch *b = arg; struct pilot p;
+        if(!pilot_init(&p, board_width, board_height)) return arg;
+
+        for(int i = b -> first; i < games; i += threads) {
+                struct game g;
+                if(!game_init(&g, board_width, board_height, seed + i)) break;
+
+                long long cells = board_width * board_height;
+
+                for(long long idle = 0; idle < 2 * cells;) {
+                        int length = g.length;
+
+                        game_turn(&g, pilot_move(&p, &g)); b -> ticks++;
+                        if(game_step(&g) == OVER) break;
+                        if(g.food < 0) { b -> won++; break; }
+
+                        idle = g.length == length ? idle + 1 : 0;
+                }
+
+                b -> score += g.score; b -> length += g.length;
+                game_free(&g);
+        }
 
-        fflush(stdout);
-        while(1) { game_main(); if(!paused) pauseprg(delay); }
+        pilot_free(&p); return NULL;
+}
+
+/* With -l, each thread instead plays its games through a batch with that
+ * many lanes, stepping them all in lockstep and starting its next game in a
+ * lane as soon as the one there ends; the totals come out the same. After
+ * each step, one pass over the lanes totals up the games that ended, and
+ * another starts new games in their lanes, or leaves them empty once the
+ * thread's share of games has been started. */
+
+void *play_lanes(void *arg) {
+        struct batch *b = arg; struct pilot p; struct games g;
+        int share = (games - b -> first + threads - 1) / threads;
+        int count = share < lanes ? share : lanes, live = count;
+        int cells = board_width * board_height;
+
+        int *actions = calloc(count, sizeof(int));
+        int *status = malloc(sizeof(int) * count);
+        int *playing = malloc(sizeof(int) * count);
+        int *length = malloc(sizeof(int) * count);
+        int *idle = malloc(sizeof(int) * count);
+        int *ended = malloc(sizeof(int) * count);
+
+        if(!actions || !status || !playing || !length || !idle || !ended)
+                return arg;
+
+        if(!pilot_init(&p, board_width, board_height)) return arg;
+        if(!games_init(&g, count, board_width, board_height, seed)) return arg;
+
+        for(int i = 0; i < count; i++) {
+                games_reset(&g, i, seed + b -> first + i * threads);
+                playing[i] = 1; length[i] = 2; idle[i] = 0;
+        }
+
+        for(int started = count; live;) {
+                for(int i = 0; i < count; i++) {
+                        struct game view; games_view(&g, i, &view);
+                        actions[i] = playing[i] ? pilot_move(&p, &view) : 0;
+                }
+
+                games_step(&g, actions, status);
+                long long ticks = 0; long score = 0, total = 0; int won = 0;
+
+                for(int i = 0; i < count; i++) {
+                        int over = status[i] == OVER, full = g.food[i] < 0;
+                        int same = g.length[i] == length[i];
+
+                        idle[i] = pick(same, idle[i] + 1, 0);
+                        length[i] = g.length[i];
+
+                        int end = playing[i]
+                                & (over | full | (idle[i] >= 2 * cells));
+
+                        ended[i] = end; ticks += playing[i];
+                        won += end & !over & full;
+                        score += end ? g.score[i] : 0;
+                        total += pick(end, g.length[i], 0);
+                }
+
+                b -> ticks += ticks; b -> won += won;
+                b -> score += score; b -> length += total;
+
+                for(int i = 0; i < count; i++) {
+                        if(!ended[i]) continue;
+
+                        if(started == share) { playing[i] = 0; live--; }
+                        else {
+                                int n = b -> first + started++ * threads;
+                                games_reset(&g, i, seed + n);
+                                length[i] = 2; idle[i] = 0;
+                        }
+                }
+        }
+
+        games_free(&g); pilot_free(&p); free(actions); free(status);
+        free(playing); free(length); free(idle); free(ended); return NULL;
+}
+
+void run_headless(char *name) {
+        if(!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads < 1) threads = 1;
+        if(threads > games) threads = games;
+
+        pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+        struct batch *batches = calloc(threads, sizeof(struct batch));
+        if(!ids || !batches) { puts(MEM_ALLOC_ERR); exit(5); }
+
+        start_ns = clock_ns();
+
+        for(int i = 0; i < threads; i++) {
+                batches[i].first = i;
+                void *(*run)(void *) = lanes ? play_lanes : play;
+                if(pthread_create(&ids[i], NULL, run, &batches[i])) {
+                        puts(PTHREAD_ERR); exit(9);
+                }
+        }
+
+        struct batch total = {0};
+
+        for(int i = 0; i < threads; i++) {
+                void *ret; pthread_join(ids[i], &ret);
+                if(ret) { puts(MEM_ALLOC_ERR); exit(5); }
+
+                total.ticks += batches[i].ticks; total.won += batches[i].won;
+                total.score += batches[i].score;
+                total.length += batches[i].length;
+        }
+
+        double secs = (clock_ns() - start_ns) / 1e9;
+
+        printf("%s: %d games on %dx%d with %d threads in %.3f s: %.1f games/s, "
+                "%.0f ticks/s, mean score %.1f, mean length %.1f, %d won.\n",
+                name, games, board_width, board_height, threads, secs,
+                games / secs, total.ticks / secs, (double) total.score / games,
+                (double) total.length / games, total.won);
+
+        dump_stats("snake", "ticks", total.ticks, 1e9 / delay); exit(0);
+}
+
+int main(int argc, char **argv) {
+        seed = time(NULL);
+
+        for(int opt; (opt = getopt(argc, argv, "ts:aS:o:i:Hn:j:l:b:")) != -1;)
+                switch(opt)
+        {
+                case 't': show_stats = 1; break;
+                case 'a': autopilot = 1; break;
+                case 'S': seed = strtoul(optarg, NULL, 0); break;
+                case 'H': headless = 1; break;
+
+        case 's':
+                stats_file = fopen(optarg, "w");
+                if(!stats_file) { printf(FOPEN_MSG, argv[0]); exit(8); }
+                break;
+
+        case 'o':
+                record_file = fopen(optarg, "w");
+                if(!record_file) { printf(FOPEN_MSG, argv[0]); exit(8); }
+                break;
+
+        case 'i':
+                replay_file = fopen(optarg, "r");
+                if(!replay_file) { printf(FOPEN_MSG, argv[0]); exit(8); }
+                break;
+
+        case 'n':
+                games = atoi(optarg);
+                if(games > 0) break;
+
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+
+        case 'j':
+                threads = atoi(optarg);
+                if(threads > 0) break;
+
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+
+        case 'l':
+                lanes = atoi(optarg);
+                if(lanes > 0) break;
+
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+
+        case 'b':
+                if(sscanf(optarg, "%dx%d", &board_width, &board_height) == 2
+                        && board_width > 1 && board_height > 0) break;
+
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+
+        default:
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+        }
+
+        if(games) run_headless(argv[0]);
+        if(headless && !replay_file) {
+                printf(USAGE_MSG, argv[0], argv[0]); exit(7);
+        }
+
+        int size[2];
+        if(replay_file) {
+                int ret = fscanf(replay_file, "snake %u %d %d %d", &seed,
+                        &size[0], &size[1], &autopilot);
+
+                if(ret != 4 || size[0] < 2 || size[1] < 1) {
+                        puts(REPLAY_ERR); exit(10);
+                }
+
+                replay_next();
+        }
+
+        if(headless) {
+                width = size[0]; height = size[1];
+                goto start;
+        }
+
+        int ret = term_open(&height, &width); height--;
+        if(ret) exit(ret);
+
+        if(replay_file && (width != size[0] || height != size[1])) {
+                puts(REPLAY_SIZE_ERR); exitprg(11);
+        }
+
+start:  if(record_file) {
+                setvbuf(record_file, NULL, _IOLBF, 0);
+                fprintf(record_file, "snake %u %d %d %d\n", seed, width,
+                        height, autopilot);
+        }
+
+        if(!game_init(&game, width, height, seed)) {
+                puts(MEM_ALLOC_ERR); exitprg(5);
+        }
+
+        if(autopilot && !pilot_init(&pilot, width, height)) {
+                puts(MEM_ALLOC_ERR); exitprg(5);
+        }
+
+        out_cols = width;
+        out_cap = (size_t) (height + 1) * (width + 16) + 64;
+        out_buf = malloc(sizeof(char) * out_cap);
+        if(!out_buf) { puts(MEM_ALLOC_ERR); exitprg(5); }
+
+        if(!headless) {
+                printf("\e[2J"); draw_banner();
+                signal(SIGWINCH, on_resize);
+        }
+
+        draw_changes(); send_out();
+        start_ns = last_ns = clock_ns();
+        if(!headless) {
+                timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+                if(timer_fd == -1) { puts(TIMER_ERR); exitprg(13); }
+        }
+
+        while(1) { if(!headless) wait_tick(); game_main(); }
         puts(NON_REACH_ERR); exitprg(6);
-}
\ No newline at end of file
+}
@@ -0,0 +1,498 @@
+/* Tiny Term: The Terminal Back End Shared by the Tiny C Programs for Linux
+ * TTYs Copyright (C) 2021-2023 Jyothiraditya Nellakra
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef TERM_H
+#define TERM_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#define FCNTL_SET_ERR "Error setting input to non-blocking with fcntl()."
+#define TCGETATTR_ERR "Error getting terminal properties with tcgetattr()."
+#define TCSETATTR_ERR "Error setting terminal properties with tcsetattr()."
+#define SCREEN_HW_ERR "Error getting screen size with ANSI escape codes."
+#define WRITE_SYS_ERR "Error writing using the write() system call."
+
+/* Everything here is static, so each program that includes this header gets
+ * its own copy, and a program split across files links all the same. */
+
+static struct termios cooked, raw;
+static int term_flags; static bool headless;
+static volatile sig_atomic_t resized;
+
+static inline void on_resize(int sig) { resized = sig; }
+
+static inline void reset_terminal() {
+	fcntl(STDIN_FILENO, F_SETFL, term_flags);
+	tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+}
+
+static inline void exitprg(int ret) {
+	if(!headless) { reset_terminal(); printf("\e[?25h"); }
+	exit(ret);
+}
+
+/* Input is made raw and non-blocking, and the size of the screen is found by
+ * sending the cursor as far as it'll go and asking where it ended up. On
+ * failure, the error is printed, the terminal is put back as it was and the
+ * exit code for the step that failed is returned: 1 to 4, the same in every
+ * program. */
+
+static inline int term_open(int *rows, int *cols) {
+	term_flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+	int ret = fcntl(STDIN_FILENO, F_SETFL, term_flags | O_NONBLOCK);
+	if(ret == -1) { puts(FCNTL_SET_ERR); return 1; }
+
+	ret = tcgetattr(STDIN_FILENO, &cooked);
+	if(ret == -1) { puts(TCGETATTR_ERR); ret = 2; goto fail; }
+
+	raw = cooked;
+	raw.c_lflag &= ~(ICANON | ECHO);
+
+	ret = tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	if(ret == -1) { puts(TCSETATTR_ERR); ret = 3; goto fail; }
+
+	printf("\e[999;999H\e[6n");
+	while(getchar() != '\e');
+
+	if(scanf("[%d;%dR", rows, cols) == 2) return 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+	puts(SCREEN_HW_ERR); ret = 4;
+
+fail:	fcntl(STDIN_FILENO, F_SETFL, term_flags);
+	return ret;
+}
+
+/* Asks the terminal for its size after a resize, which unlike term_open()
+ * doesn't have to wait on a reply. */
+
+static inline bool term_size(int *rows, int *cols) {
+	struct winsize ws;
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return false;
+
+	*rows = ws.ws_row; *cols = ws.ws_col;
+	return true;
+}
+
+/* Frames are built up in out_buf and handed to write() in one go; with -H,
+ * there's no terminal and they're dropped instead. The cursor and the last
+ * attribute set are tracked so that moves go relative to where the cursor was
+ * left when that's shorter, and attributes are only sent when they change.
+ * Coordinates are on the screen, counted from zero, and out_x is -1 when the
+ * cursor's whereabouts aren't known, as after writing to the last of out_cols
+ * columns or anything sent through stdio. The program allocates out_buf big
+ * enough for a frame and keeps out_cols at its width. */
+
+static char *out_buf; static size_t out_len;
+static int out_cols, out_x = -1, out_y, out_sgr = -1;
+
+static inline void out_put(const char *s, size_t n) {
+	memcpy(out_buf + out_len, s, n); out_len += n;
+	if(out_x >= 0 && (out_x += n) >= out_cols) out_x = -1;
+}
+
+static inline void out_attr(int sgr) {
+	if(sgr == out_sgr) return;
+	out_len += sprintf(out_buf + out_len, "\e[%dm", sgr);
+	out_sgr = sgr;
+}
+
+/* Writes the shortest way of moving the cursor from (from_x, from_y) to (x, y)
+ * into s and returns its length. It's addressed outright if from_x is -1. */
+
+static inline size_t term_move(char *s, int from_x, int from_y, int x, int y) {
+	char move[32]; int rel = 0;
+
+	int len = sprintf(s, "\e[%d;%dH", y + 1, x + 1);
+	if(from_x < 0) return len;
+
+	if(y != from_y) rel = sprintf(move, "\e[%d%c", abs(y - from_y),
+		y < from_y ? 'A' : 'B');
+
+	if(!x && from_x) move[rel++] = '\r';
+	else if(x != from_x) rel += sprintf(move + rel, "\e[%d%c",
+		abs(x - from_x), x < from_x ? 'D' : 'C');
+
+	if(rel < len) { memcpy(s, move, rel); len = rel; }
+	return len;
+}
+
+static inline void out_goto(int x, int y) {
+	if(x == out_x && y == out_y) return;
+	out_len += term_move(out_buf + out_len, out_x, out_y, x, y);
+	out_x = x; out_y = y;
+}
+
+/* A slow terminal can leave stdout unable to take any more, in which case the
+ * write waits in poll() until it can. Both return false if write() fails. */
+
+static inline bool term_write(const char *s, size_t len) {
+	struct pollfd out = {STDOUT_FILENO, POLLOUT, 0};
+
+	while(len) {
+		ssize_t ret = write(STDOUT_FILENO, s, len);
+		if(ret != -1) { s += ret; len -= ret; }
+		else if(errno == EAGAIN) poll(&out, 1, -1);
+		else if(errno != EINTR) return false;
+	}
+
+	return true;
+}
+
+static inline bool flush_out() {
+	size_t len = out_len; out_len = 0;
+	if(headless) return true;
+
+	fflush(stdout);
+	return term_write(out_buf, len);
+}
+
+/* Each phase of a frame is timed into a histogram of power-of-two buckets of
+ * nanoseconds: compute for the program's own work, render for building the
+ * frame and output for sending it. The status line shows averages over the
+ * last half second while it's turned on, and with -s, the totals are written
+ * out as JSON when the program ends. */
+
+#define STATS_BUCKETS 32
+#define STATS_PERIOD 500000000LL
+
+struct stats {
+	const char *name; size_t count, last_count;
+	long long total, last_total, max; size_t hist[STATS_BUCKETS];
+};
+
+static struct stats compute_stats = {.name = "compute"};
+static struct stats render_stats = {.name = "render"};
+static struct stats output_stats = {.name = "output"};
+
+static size_t frames, last_frames, bytes_out, last_bytes, max_bytes;
+static size_t status_steps; static long long start_ns, last_ns;
+static char status[256]; static bool status_stale; static FILE *stats_file;
+
+static inline long long clock_ns() {
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline void stats_add(struct stats *s, long long ns) {
+	int i = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+	s -> hist[i < STATS_BUCKETS ? i : STATS_BUCKETS - 1]++;
+	s -> count++; s -> total += ns; if(ns > s -> max) s -> max = ns;
+}
+
+static inline double stats_ms(struct stats *s) {
+	size_t n = s -> count - s -> last_count;
+	double ms = n ? (s -> total - s -> last_total) / 1e6 / n : 0.0;
+
+	s -> last_count = s -> count; s -> last_total = s -> total;
+	return ms;
+}
+
+static inline void stats_frame(size_t bytes) {
+	frames++; bytes_out += bytes;
+	if(bytes > max_bytes) max_bytes = bytes;
+}
+
+/* Remakes the status line once a period has passed, with how fast the
+ * program's steps have gone by, labelled by rate, against its target. Returns
+ * true if it did, with status_stale set so that it gets drawn. */
+
+static inline bool update_status(size_t steps, const char *rate,
+	double target)
+{
+	long long now = clock_ns();
+	if(now - last_ns < STATS_PERIOD) return false;
+
+	double done = (steps - status_steps) * 1e9 / (now - last_ns);
+	size_t n = frames - last_frames;
+	size_t bytes = n ? (bytes_out - last_bytes) / n : 0;
+
+	snprintf(status, sizeof(status), "%.1f %s (target %.1f), compute "
+		"%.3f ms, render %.3f ms, output %.3f ms, %zu B/frame", done,
+		rate, target, stats_ms(&compute_stats), stats_ms(&render_stats),
+		stats_ms(&output_stats), bytes);
+
+	last_ns = now; status_steps = steps;
+	last_frames = frames; last_bytes = bytes_out;
+	return status_stale = true;
+}
+
+static inline void dump_phase(struct stats *s, const char *sep) {
+	fprintf(stats_file, "\t\t\"%s\": {\"count\": %zu, \"total_ns\": %lld, "
+		"\"max_ns\": %lld, \"hist_log2_ns\": [", s -> name, s -> count,
+		s -> total, s -> max);
+
+	for(int i = 0; i < STATS_BUCKETS; i++)
+		fprintf(stats_file, i ? ", %zu" : "%zu", s -> hist[i]);
+
+	fprintf(stats_file, "]}%s\n", sep);
+}
+
+/* The totals count the program's steps under the name unit, or leave them
+ * out if unit is NULL, when they're just its frames. A program with more of
+ * its own to add writes it between stats_open() and stats_close(). */
+
+static inline bool stats_open(const char *program, const char *unit,
+	size_t steps, double target)
+{
+	if(!stats_file) return false;
+
+	struct rusage usage; getrusage(RUSAGE_SELF, &usage);
+	double secs = (clock_ns() - start_ns) / 1e9;
+
+	fprintf(stats_file, "{\n\t\"program\": \"%s\",\n", program);
+	fprintf(stats_file, "\t\"seconds\": %f,\n", secs);
+	if(unit) fprintf(stats_file, "\t\"%s\": %zu,\n", unit, steps);
+	fprintf(stats_file, "\t\"frames\": %zu,\n", frames);
+	fprintf(stats_file, "\t\"target_rate\": %f,\n", target);
+	fprintf(stats_file, "\t\"achieved_rate\": %f,\n", steps / secs);
+	fprintf(stats_file, "\t\"bytes_out\": %zu,\n", bytes_out);
+	fprintf(stats_file, "\t\"max_frame_bytes\": %zu,\n", max_bytes);
+	fprintf(stats_file, "\t\"max_rss_kb\": %ld,\n", usage.ru_maxrss);
+	return true;
+}
+
+static inline void stats_close() {
+	fprintf(stats_file, "\t\"phases\": {\n");
+	dump_phase(&compute_stats, ","); dump_phase(&render_stats, ",");
+	dump_phase(&output_stats, ""); fprintf(stats_file, "\t}\n}\n");
+	fclose(stats_file);
+}
+
+static inline void dump_stats(const char *program, const char *unit,
+	size_t steps, double target)
+{
+	if(stats_open(program, unit, steps, target)) stats_close();
+}
+
+/* With -o, a program logs each key it takes as a line giving how many of its
+ * steps have passed since the last key and then the key, after a header line
+ * of its own. With -i, it reads the header back, calls replay_next() for the
+ * first key and takes each key when replay_due() says its step has come. */
+
+static FILE *record_file, *replay_file;
+static size_t last_step, next_step; static int next_key = EOF;
+
+static inline void replay_next() {
+	size_t gap;
+	if(fscanf(replay_file, "%zu %d", &gap, &next_key) == 2)
+		next_step += gap;
+	else next_key = EOF;
+}
+
+static inline bool replay_due(size_t step) {
+	return next_key != EOF && next_step == step;
+}
+
+static inline void record_key(size_t step, int ch) {
+	if(!record_file) return;
+	fprintf(record_file, "%zu %d\n", step - last_step, ch);
+	last_step = step;
+}
+
+/* Checkpoints are a text header followed by the board packed eight cells to a
+ * byte, one plane per cell state, and run-length encoded when that's smaller.
+ * The program only packs the board; compressing and writing it happens on a
+ * thread of its own, into a temporary file that's renamed over the old
+ * checkpoint once complete, so being killed mid-write loses nothing. Before
+ * any of it, a program sets ckpt_magic, ckpt_cells with one character for
+ * each cell state that's saved, and ckpt_get and ckpt_put for reading and
+ * writing a cell of its board, where a space is a dead cell. */
+
+static const char *ckpt_magic, *ckpt_cells;
+static char (*ckpt_get)(size_t x, size_t y);
+static void (*ckpt_put)(size_t x, size_t y, char ch);
+
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ckpt_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ckpt_done = PTHREAD_COND_INITIALIZER;
+
+static unsigned char *ckpt_buf, *ckpt_rle;
+static size_t ckpt_size, ckpt_cap, ckpt_generation, ckpt_w, ckpt_h;
+static bool ckpt_pending; static char *ckpt_name; static FILE *load_file;
+static long long ckpt_period = 60000000000LL, ckpt_last;
+
+static inline void ckpt_pack(size_t generation, size_t w, size_t h) {
+	size_t cells = w * h;
+	memset(ckpt_buf, 0, ckpt_size);
+
+	for(size_t i = 0; i < cells; i++) {
+		char ch = ckpt_get(i % w, i / w);
+
+		for(size_t p = 0, j = i; ckpt_cells[p]; p++, j += cells)
+			if(ch == ckpt_cells[p]) ckpt_buf[j / 8] |= 1 << j % 8;
+	}
+
+	ckpt_generation = generation; ckpt_w = w; ckpt_h = h;
+}
+
+static inline size_t ckpt_compress() {
+	size_t len = 0;
+
+	for(size_t i = 0, j; i < ckpt_size; i = j) {
+		for(j = i + 1; j < ckpt_size && j - i < 255; j++)
+			if(ckpt_buf[j] != ckpt_buf[i]) break;
+
+		if(len + 2 >= ckpt_size) return 0;
+		ckpt_rle[len++] = j - i; ckpt_rle[len++] = ckpt_buf[i];
+	}
+
+	return len;
+}
+
+static inline bool ckpt_write() {
+	char tmp[strlen(ckpt_name) + 5]; sprintf(tmp, "%s.tmp", ckpt_name);
+	size_t len = ckpt_compress();
+
+	FILE *file = fopen(tmp, "wb");
+	if(!file) return false;
+
+	fprintf(file, "%s %zu %zu %zu %d\n", ckpt_magic, ckpt_w, ckpt_h,
+		ckpt_generation, len != 0);
+
+	fwrite(len ? ckpt_rle : ckpt_buf, 1, len ? len : ckpt_size, file);
+	bool ok = !ferror(file) && !fflush(file) && !fsync(fileno(file));
+
+	if(!fclose(file) && ok && !rename(tmp, ckpt_name)) return true;
+	unlink(tmp); return false;
+}
+
+static inline void *ckpt_writer(void *arg) {
+	pthread_mutex_lock(&ckpt_lock);
+
+	while(true) {
+		while(!ckpt_pending) pthread_cond_wait(&ckpt_ready, &ckpt_lock);
+		pthread_mutex_unlock(&ckpt_lock);
+
+		ckpt_write();
+
+		pthread_mutex_lock(&ckpt_lock);
+		ckpt_pending = false; pthread_cond_signal(&ckpt_done);
+	}
+
+	return arg;
+}
+
+/* Makes room for packing a board of the given number of cells, once any
+ * checkpoint still being written is done with the old buffers. */
+
+static inline bool ckpt_resize(size_t cells) {
+	pthread_mutex_lock(&ckpt_lock);
+	while(ckpt_pending) pthread_cond_wait(&ckpt_done, &ckpt_lock);
+
+	ckpt_size = (strlen(ckpt_cells) * cells + 7) / 8;
+	bool ok = ckpt_size <= ckpt_cap;
+
+	if(!ok && (ckpt_buf = realloc(ckpt_buf, ckpt_size))
+		&& (ckpt_rle = realloc(ckpt_rle, ckpt_size)))
+	{
+		ckpt_cap = ckpt_size; ok = true;
+	}
+
+	pthread_mutex_unlock(&ckpt_lock);
+	return ok;
+}
+
+/* Called between steps, with the board not about to change. If the last
+ * checkpoint is still being written, this one is skipped rather than holding
+ * up the program. */
+
+static inline void ckpt_start(size_t generation, size_t w, size_t h) {
+	long long now = clock_ns();
+	if(!ckpt_name || now - ckpt_last < ckpt_period) return;
+
+	pthread_mutex_lock(&ckpt_lock);
+
+	if(!ckpt_pending) {
+		ckpt_pack(generation, w, h);
+		ckpt_pending = true; ckpt_last = now;
+		pthread_cond_signal(&ckpt_ready);
+	}
+
+	pthread_mutex_unlock(&ckpt_lock);
+}
+
+/* The final checkpoint waits for any write in progress and is then written
+ * directly. ckpt_lock is kept, as nothing else should start while we exit. */
+
+static inline bool ckpt_finish(size_t generation, size_t w, size_t h) {
+	if(!ckpt_name) return true;
+
+	pthread_mutex_lock(&ckpt_lock);
+	while(ckpt_pending) pthread_cond_wait(&ckpt_done, &ckpt_lock);
+
+	ckpt_pack(generation, w, h); return ckpt_write();
+}
+
+/* Reads load_file onto a board of width by height cells, and its generation
+ * into *generation. A checkpoint from a differently sized terminal is cropped
+ * or padded with dead cells, keeping the top left corner where it was. */
+
+static inline bool ckpt_load(size_t *generation, size_t width, size_t height)
+{
+	char magic[32]; size_t w, h, gen; int rle;
+
+	int ret = fscanf(load_file, "%31s %zu %zu %zu %d", magic, &w, &h,
+		&gen, &rle);
+
+	if(ret != 5 || strcmp(magic, ckpt_magic) || fgetc(load_file) != '\n'
+		|| !w || !h) return false;
+
+	size_t cells = w * h, size = (strlen(ckpt_cells) * cells + 7) / 8;
+	unsigned char *bits = malloc(size);
+	if(!bits) return false;
+
+	if(!rle && fread(bits, 1, size, load_file) != size) goto fail;
+
+	for(size_t i = 0; rle && i < size;) {
+		int n = fgetc(load_file), byte = fgetc(load_file);
+		if(n < 1 || byte == EOF || i + n > size) goto fail;
+		memset(bits + i, byte, n); i += n;
+	}
+
+	for(size_t y = 0; y < height; y++)
+	for(size_t x = 0; x < width; x++) {
+		char ch = ' ';
+
+		for(size_t p = 0; ckpt_cells[p] && x < w && y < h; p++) {
+			size_t i = p * cells + y * w + x;
+			if(bits[i / 8] >> i % 8 & 1) ch = ckpt_cells[p];
+		}
+
+		ckpt_put(x, y, ch);
+	}
+
+	*generation = gen; free(bits); fclose(load_file);
+	return true;
+
+fail:	free(bits); return false;
+}
+
+#endif